@@ -0,0 +1,215 @@
+// Esmel 基准测试
+// 对每个 .esm 工作负载重复执行（编译 + 运行），以单调时钟计时，输出中位数与分位数，
+// 可写出JSON结果，并与保存的基线比较以发现性能回退。
+//
+// 用法: esmel_bench [--runs N] [--warmup N] [--json out.json] [--baseline base.json]
+//                   [--threshold 0.10] [--filter name] [--compile-only] [workload.esm|dir ...]
+//
+// --compile-only 只测量编译时间，并额外加入一个自动生成的大型程序 synthetic_compile。
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "esmel_compiler.h"
+#include "esmel_interpreter.h"
+
+#ifndef ESMEL_BENCH_DIR
+#define ESMEL_BENCH_DIR "bench"
+#endif
+
+struct bench_result {
+	std::string name;
+	std::vector<double> samples;	// 毫秒
+	double min{}, median{}, p90{}, p99{}, max{};
+};
+
+static double percentile(const std::vector<double>& sorted, const double p) {
+	if (sorted.empty()) return 0;
+	const double rank = p * static_cast<double>(sorted.size() - 1);
+	const auto lo = static_cast<size_t>(rank);
+	const size_t hi = std::min(lo + 1, sorted.size() - 1);
+	return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - static_cast<double>(lo));
+}
+
+// 生成一个大型程序，用于测量编译吞吐量
+static std::string generate_program(const int functions, const int lines) {
+	const auto path = (std::filesystem::temp_directory_path() / "synthetic_compile.esm").string();
+	std::ofstream out(path);
+	for (int f = 0; f < functions; f++) {
+		out << "Function Helper" << f << " a b\n";
+		out << "    Set total 0\n";
+		out << "    Set counter 0\n";
+		out << "    Label Loop\n";
+		for (int l = 0; l < lines; l++) {
+			out << "    Add total + * a " << l << " - b counter\n";
+			out << "    Set flag" << l % 8 << " And Less? total 1000000 GreaterEqual? counter 0\n";
+			out << "    Println Link \"value: \" \"" << l << "\" If Equal? % counter 97 " << l << "\n";
+		}
+		out << "    Add counter 1\n";
+		out << "    Done If GreaterEqual? counter 10\n";
+		out << "    Loop\n";
+		out << "    Label Done\n";
+		out << "    Return + total 0.5\n\n";
+	}
+	out << "Function Main\n";
+	out << "    Println Helper0 1 2\n";
+	return path;
+}
+
+// 编译并运行一次，返回耗时（毫秒）
+static double run_once(std::string file, const bool compile_only) {
+	const auto start = std::chrono::steady_clock::now();
+
+	auto* e = new esmel_compiler();
+	e->add_target(file);
+	e->compile();
+	if (compile_only) {
+		delete e;
+	} else {
+		EsmelInterpreter esm;
+		esm.functions = e->esmel_functions;
+		esm.static_str = e->static_strs;
+		delete e;
+		esm.call(0);
+	}
+
+	const auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// 读取本程序写出的JSON（每个工作负载一行）
+static std::unordered_map<std::string, double> load_baseline(const std::string& path) {
+	std::unordered_map<std::string, double> result;
+	std::ifstream in(path);
+	if (!in.is_open()) {
+		std::cerr << "Error: Cannot open baseline: " << path << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		const auto name_pos = line.find("\"name\": \"");
+		const auto median_pos = line.find("\"median_ms\": ");
+		if (name_pos == std::string::npos || median_pos == std::string::npos) continue;
+		const auto name_begin = name_pos + 9;
+		const auto name_end = line.find('"', name_begin);
+		result[line.substr(name_begin, name_end - name_begin)] = std::stod(line.substr(median_pos + 13));
+	}
+	return result;
+}
+
+static void write_json(std::ostream& out, const std::vector<bench_result>& results, const int runs) {
+	out << "{\n  \"runs\": " << runs << ",\n  \"workloads\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const auto& r = results[i];
+		out << "    {\"name\": \"" << r.name << "\", \"median_ms\": " << r.median << ", \"min_ms\": " << r.min
+			<< ", \"p90_ms\": " << r.p90 << ", \"p99_ms\": " << r.p99 << ", \"max_ms\": " << r.max << '}'
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+	ios_base::sync_with_stdio(false);
+	int runs = 10;
+	int warmup = 1;
+	double threshold = 0.10;
+	bool compile_only = false;
+	std::string json_path, baseline_path, filter;
+	std::vector<std::string> inputs;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		auto next = [&]() -> std::string {
+			if (i + 1 >= argc) {
+				std::cerr << "Error: Missing value for " << arg << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			return argv[++i];
+		};
+		if (arg == "--runs") runs = std::max(1, std::stoi(next()));
+		else if (arg == "--warmup") warmup = std::max(0, std::stoi(next()));
+		else if (arg == "--json") json_path = next();
+		else if (arg == "--baseline") baseline_path = next();
+		else if (arg == "--threshold") threshold = std::stod(next());
+		else if (arg == "--filter") filter = next();
+		else if (arg == "--compile-only") compile_only = true;
+		else inputs.push_back(arg);
+	}
+	if (inputs.empty()) inputs.emplace_back(ESMEL_BENCH_DIR);
+
+	std::vector<std::string> files;
+	for (const auto& input: inputs) {
+		if (std::filesystem::is_directory(input)) {
+			for (const auto& entry: std::filesystem::directory_iterator(input)) {
+				if (entry.path().extension() == ".esm") files.push_back(entry.path().string());
+			}
+		} else {
+			files.push_back(input);
+		}
+	}
+	std::ranges::sort(files);
+	if (compile_only) files.push_back(generate_program(2000, 20));
+
+	// 运行期间丢弃脚本输出
+	std::ostringstream sink;
+	std::vector<bench_result> results;
+	for (const auto& file: files) {
+		bench_result r;
+		r.name = std::filesystem::path(file).stem().string();
+		if (!filter.empty() && r.name.find(filter) == std::string::npos) continue;
+
+		auto* old = std::cout.rdbuf(sink.rdbuf());
+		for (int i = 0; i < warmup; i++) run_once(file, compile_only);
+		for (int i = 0; i < runs; i++) {
+			r.samples.push_back(run_once(file, compile_only));
+			sink.str("");
+		}
+		std::cout.rdbuf(old);
+
+		std::vector<double> sorted = r.samples;
+		std::ranges::sort(sorted);
+		r.min = sorted.front();
+		r.max = sorted.back();
+		r.median = percentile(sorted, 0.5);
+		r.p90 = percentile(sorted, 0.9);
+		r.p99 = percentile(sorted, 0.99);
+		results.push_back(r);
+
+		std::cout << std::left << std::setw(20) << r.name << std::fixed << std::setprecision(3)
+			<< " median " << std::setw(10) << r.median << " p90 " << std::setw(10) << r.p90
+			<< " p99 " << std::setw(10) << r.p99 << " (ms, " << runs << " runs)" << std::endl;
+	}
+
+	if (!json_path.empty()) {
+		std::ofstream out(json_path);
+		write_json(out, results, runs);
+	}
+
+	if (baseline_path.empty()) return 0;
+
+	// 与基线比较：中位数变慢超过阈值即视为回退
+	const auto baseline = load_baseline(baseline_path);
+	bool regressed = false;
+	std::cout << std::endl << "Compared with " << baseline_path << " (threshold " << threshold * 100 << "%):" << std::endl;
+	for (const auto& r: results) {
+		const auto it = baseline.find(r.name);
+		if (it == baseline.end()) {
+			std::cout << std::setw(20) << r.name << " (no baseline)" << std::endl;
+			continue;
+		}
+		const double change = (r.median - it->second) / it->second;
+		const bool bad = change > threshold;
+		regressed |= bad;
+		std::cout << std::setw(20) << r.name << ' ' << std::showpos << change * 100 << std::noshowpos << "% "
+			<< (bad ? "REGRESSION" : "ok") << std::endl;
+	}
+	return regressed ? 1 : 0;
+}
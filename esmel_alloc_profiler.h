@@ -0,0 +1,121 @@
+#pragma once
+
+#include <csignal>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "esmel_callable.h"
+
+// 分配位置分析器（内存分析）。
+// 每个新建的字符串与数组记下分配它的位置（函数与行）的编号，数组扩容的字节数也计入当时所在的行；
+// 每次 GC 清除之后按存活对象的编号统计存活个数与存活字节数。
+// 结果在退出时写出，运行中收到 SIGUSR1 时在下一次 GC 之后写出（此时的存活数据是最新的）。
+class EsmelAllocProfiler {
+	struct site {
+		uint32_t function_id = UINT32_MAX;	// 超出函数范围表示未知位置
+		uint32_t line = 0;					// 指令行号（报告时换算为源文件行号）
+		uint64_t objects = 0;				// 分配的对象数
+		uint64_t bytes = 0;					// 分配的字节数（含之后的扩容）
+		uint64_t survived = 0;				// 各次 GC 中存活的对象数之和
+		uint64_t live_objects = 0;			// 最近一次 GC 后存活的对象数
+		uint64_t live_bytes = 0;			// 最近一次 GC 后存活的字节数
+	};
+
+	std::vector<site> sites = std::vector<site>(1);		// 0 为未知位置（映像中读入的、并行工作线程中创建的对象）
+	std::unordered_map<uint64_t, uint32_t> site_ids;	// (函数id << 32 | 行号) -> 编号
+	uint64_t collections = 0;
+
+	static void on_signal(int) {
+		requested = 1;
+	}
+
+public:
+	static inline volatile std::sig_atomic_t requested = 0;	// 收到 SIGUSR1，等待写出报告
+
+	std::string output_prefix = "esmel";					// 输出 <prefix>.alloc
+	std::function<std::pair<uint32_t, uint32_t>()> locate;	// 当前执行位置 (函数id, 行号)，由解释器提供
+
+	void start() {
+		signal(SIGUSR1, on_signal);
+	}
+
+	// 当前位置的编号
+	uint32_t current_site() {
+		const auto [function_id, line] = locate();
+		const auto [it, added] = site_ids.try_emplace(static_cast<uint64_t>(function_id) << 32 | line,
+			static_cast<uint32_t>(sites.size()));
+		if (added) sites.push_back({function_id, line});
+		return it->second;
+	}
+
+	// 记录一个新对象，返回其分配位置的编号
+	uint32_t allocated(const uint64_t bytes) {
+		const uint32_t id = current_site();
+		sites[id].objects++;
+		sites[id].bytes += bytes;
+		return id;
+	}
+
+	// 已有对象的增长（数组扩容、写时复制）计入当前位置
+	void grew(const uint64_t bytes) {
+		sites[current_site()].bytes += bytes;
+	}
+
+	// GC 清除之后：先调用 begin_survey，再对每个存活对象调用 survived
+	void begin_survey() {
+		collections++;
+		for (auto& s: sites) {
+			s.live_objects = 0;
+			s.live_bytes = 0;
+		}
+	}
+
+	void survived(const uint32_t id, const uint64_t bytes) {
+		site& s = sites[id < sites.size() ? id : 0];
+		s.survived++;
+		s.live_objects++;
+		s.live_bytes += bytes;
+	}
+
+	// 写出报告，同一源文件行的不同指令行合并为一项，按分配的字节数从多到少排列
+	void report(const std::vector<esmel_function>& functions) const {
+		std::map<std::pair<uint32_t, uint64_t>, site> lines;
+		for (const auto& s: sites) {
+			const bool known = s.function_id < functions.size();
+			uint64_t line = 0;
+			if (known && s.line < functions[s.function_id].real_line_num.size()) line = functions[s.function_id].real_line_num[s.line];
+			site& total = lines[{known ? s.function_id : UINT32_MAX, line}];
+			total.objects += s.objects;
+			total.bytes += s.bytes;
+			total.survived += s.survived;
+			total.live_objects += s.live_objects;
+			total.live_bytes += s.live_bytes;
+		}
+		std::vector<std::pair<std::pair<uint32_t, uint64_t>, site>> sorted(lines.begin(), lines.end());
+		std::ranges::sort(sorted, [](const auto& a, const auto& b) { return a.second.bytes > b.second.bytes; });
+
+		std::ofstream out(output_prefix + ".alloc");
+		out << "# Esmel allocation profile: " << collections << " collections, live columns as of the last one\n\n";
+		out << std::left << std::setw(16) << "allocated(B)" << std::setw(12) << "objects" << std::setw(12) << "survived"
+			<< std::setw(14) << "live(B)" << std::setw(12) << "live" << "location\n";
+		for (const auto& [loc, s]: sorted) {
+			if (s.objects == 0 && s.bytes == 0 && s.live_objects == 0) continue;
+			out << std::setw(16) << s.bytes << std::setw(12) << s.objects << std::setw(12) << s.survived
+				<< std::setw(14) << s.live_bytes << std::setw(12) << s.live_objects;
+			if (loc.first < functions.size()) {
+				out << functions[loc.first].name << " (" << functions[loc.first].file_name << ':' << loc.second << ")\n";
+			} else {
+				out << "(unknown)\n";
+			}
+		}
+	}
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+// 二进制文件（程序映像、模块目标文件、序列化的值）的读写：小端的定长整数、带长度的字符串与编译后的函数。
+// 读取时只读映射整个文件。
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "esmel_callable.h"
+
+// 只读映射的文件，析构时解除映射
+class esmel_mapped_file {
+public:
+	const char* data = nullptr;
+	size_t size = 0;
+
+	esmel_mapped_file() = default;
+	esmel_mapped_file(const esmel_mapped_file&) = delete;
+	esmel_mapped_file& operator=(const esmel_mapped_file&) = delete;
+
+	~esmel_mapped_file() {
+		if (size) munmap(const_cast<char*>(data), size);
+	}
+
+	// 文件不存在或无法映射时返回 false；空文件不需要映射，data 为空
+	bool map(const std::string& path) {
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st{};
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return false;
+		}
+		if (st.st_size == 0) {
+			close(fd);
+			return true;
+		}
+		void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return false;
+		// 文件通常从头到尾读取一遍，让内核提前读入后面的页
+		madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+		data = static_cast<const char*>(p);
+		size = static_cast<size_t>(st.st_size);
+		return true;
+	}
+};
+
+class esmel_binary_writer {
+public:
+	std::string out;
+
+	template <class T>
+	void put(const T value) {
+		out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	void put_string(const std::string_view s) {
+		put<uint64_t>(s.size());
+		out += s;
+	}
+
+	// 文件头：魔数、格式版本与操作码个数
+	void put_header(const char (&magic)[8], const uint32_t version) {
+		out.append(magic, sizeof(magic));
+		put<uint32_t>(version);
+		put<uint32_t>(static_cast<uint32_t>(operation::EndEnum));
+	}
+
+	void put_function(const esmel_function& func) {
+		put<uint64_t>(func.arguments);
+		put<uint64_t>(func.variable_count);
+		put<uint8_t>(func.memoize);
+		put_string(func.name);
+		put_string(func.file_name);
+		put<uint64_t>(func.code.size());
+		for (const auto& line: func.code) {
+			put<uint64_t>(line.size());
+			for (const auto& [op, data]: line) {
+				put<uint32_t>(static_cast<uint32_t>(op));
+				put<uint64_t>(data);
+			}
+		}
+		put<uint64_t>(func.real_line_num.size());
+		for (const uint64_t n: func.real_line_num) put<uint64_t>(n);
+		put<uint64_t>(func.loops.size());
+		for (const auto& [preheader, header, end]: func.loops) {
+			put<uint64_t>(preheader);
+			put<uint64_t>(header);
+			put<uint64_t>(end);
+		}
+		put<uint64_t>(func.stack_maps.size());
+		for (const auto& slots: func.stack_maps) {
+			put<uint64_t>(slots.size());
+			for (const uint32_t s: slots) put<uint32_t>(s);
+		}
+	}
+
+	bool save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return false;
+		file.write(out.data(), static_cast<std::streamsize>(out.size()));
+		return file.good();
+	}
+};
+
+// 读取时检查越界：数据不足或数值不合理时 ok 置为 false，之后读到的都是零值
+class esmel_binary_reader {
+	esmel_mapped_file file;
+
+public:
+	const char* data = nullptr;
+	size_t size = 0;
+	size_t pos = 0;
+	bool ok = true;
+
+	esmel_binary_reader() = default;
+	esmel_binary_reader(const esmel_binary_reader&) = delete;
+	esmel_binary_reader& operator=(const esmel_binary_reader&) = delete;
+
+	// 映射整个文件，文件不存在时返回 false
+	bool map(const std::string& path) {
+		if (!file.map(path)) return false;
+		data = file.data;
+		size = file.size;
+		return true;
+	}
+
+	template <class T>
+	T get() {
+		T value{};
+		if (pos + sizeof(T) > size) {
+			ok = false;
+			return value;
+		}
+		std::memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+
+	// 读取元素个数，个数不可能超过剩余字节数时视为损坏
+	uint64_t get_count(const size_t element_size) {
+		const auto n = get<uint64_t>();
+		if (n > (size - pos) / element_size) {
+			ok = false;
+			return 0;
+		}
+		return n;
+	}
+
+	std::string get_string() {
+		const uint64_t n = get_count(1);
+		std::string s(data + pos, n);
+		pos += n;
+		return s;
+	}
+
+	// 读取固定的文件头（魔数与版本），不匹配时返回 false
+	bool expect(const char (&magic)[8], const uint32_t version) {
+		if (size < sizeof(magic) || std::memcmp(data, magic, sizeof(magic)) != 0) {
+			ok = false;
+			return false;
+		}
+		pos = sizeof(magic);
+		// 操作码编号不同的构建之间不通用
+		if (get<uint32_t>() != version || get<uint32_t>() != static_cast<uint32_t>(operation::EndEnum)) ok = false;
+		return ok;
+	}
+
+	esmel_function get_function() {
+		esmel_function func;
+		func.arguments = get<uint64_t>();
+		func.variable_count = get<uint64_t>();
+		func.memoize = get<uint8_t>() != 0;
+		func.name = get_string();
+		func.file_name = get_string();
+		func.code.resize(get_count(sizeof(uint64_t)));
+		for (auto& line: func.code) {
+			line.resize(get_count(sizeof(uint32_t) + sizeof(uint64_t)));
+			for (auto& [op, value]: line) {
+				const auto code = get<uint32_t>();
+				if (code >= static_cast<uint32_t>(operation::EndEnum)) ok = false;
+				op = static_cast<operation>(code);
+				value = get<uint64_t>();
+			}
+		}
+		func.real_line_num.resize(get_count(sizeof(uint64_t)));
+		for (auto& n: func.real_line_num) n = get<uint64_t>();
+		func.loops.resize(get_count(3 * sizeof(uint64_t)));
+		for (auto& [preheader, header, end]: func.loops) {
+			preheader = get<uint64_t>();
+			header = get<uint64_t>();
+			end = get<uint64_t>();
+			if (preheader >= func.code.size() || header >= func.code.size() || end >= func.code.size()) ok = false;
+		}
+		func.stack_maps.resize(get_count(sizeof(uint64_t)));
+		for (auto& slots: func.stack_maps) {
+			slots.resize(get_count(sizeof(uint32_t)));
+			for (auto& s: slots) {
+				s = get<uint32_t>();
+				if (s >= func.variable_count) ok = false;
+			}
+		}
+		if (func.real_line_num.size() != func.code.size()) ok = false;
+		if (!func.stack_maps.empty() && func.stack_maps.size() != func.code.size()) ok = false;
+		return func;
+	}
+};
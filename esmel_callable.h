@@ -1,7 +1,10 @@
 #pragma once
 
-#include <vector>
+#include <array>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "esmel_object.h"
 
@@ -26,81 +29,210 @@ enum class operation: uint32_t{
 	Greater,
 	EGreater,
 	NewArray, SetAt, GetAt, Append, GetLength, Link,
+	GetHeapSize, GetPeakHeapSize,
+	GotoUnless,							// While 循环头：条件为假时跳出循环
+	LoadInvariant, StoreInvariant,		// 外提的循环不变量：已计算则直接取值并跳过表达式
+	GetAtUnchecked, SetAtUnchecked,		// 编译期已证明类型与下标安全的数组访问
+	GetStaticStrLocal, NewArrayLocal, CopyLocal, LinkLocal,		// 不会逃出栈帧的分配，放在栈帧区域中
+	Spawn, Yield, Await,				// 协程
+	ParallelMap, ParallelFor,			// 在线程池上对数组的每个元素并行调用函数
+	Snapshot,							// 保存程序映像
+	CallNative,							// 调用注册的原生函数
+	Serialize, Deserialize,				// 值与二进制文件之间的转换
+	ReadFile, Substring, Split,			// 文件内容与字符串切片
+	Sort, SortBy,						// 数组排序（SortBy 按函数求出的键）
+	Find, Contains, Replace, Trim,		// 字符串查找与处理
+	LazyCompile,						// 按需编译的函数的桩：第一次执行时编译函数并替换自身
 
 	EndEnum // 仅用于标识最大枚举值！
 };
 
-const std::unordered_map<std::string, Type> types = {
-	{"Int", Type::INT},
-	{"Float", Type::FLOAT},
-	{"Boolean", Type::BOOLEAN},
-	{"String", Type::STRING},
-	{"Array", Type::ARRAY},
-	{"UndefinedType", Type::UNDEFINED},
-	{"Type", Type::TYPE}
+// 关键字种类
+enum class keyword_kind: uint8_t {
+	builtin,		// 内置操作
+	vari_only,		// 只能用于变量的操作，如Set Add等。用于编译时优化
+	call_only,		// 只能用于函数调用的操作，如Spawn、ParallelMap、SortBy
+	type,			// 类型名
+	literal,		// True False Undefined
+	invalid			// 无效的变量名，value 为 invalid_hints 的下标
+};
+
+struct esmel_keyword {
+	std::string_view name;
+	keyword_kind kind;
+	uint32_t value;
 };
 
-const std::unordered_map<std::string, operation> vari_only_builtin = {
-	// 只能用于变量的操作，如Set Add等。用于编译时优化
-	{"Add", operation::AddBy},
-	{"Sub", operation::SubBy},
-	{"Mul", operation::MulBy},
-	{"Div", operation::DivBy},
-	{"Mod", operation::ModBy},
-	{"Set", operation::SetVar},
-	{"Input", operation::Input}
+constexpr std::string_view invalid_hints[] = {
+	"Int", "Float", "Boolean", "String", "Array", "Undefined",
+	"Add", "Sub", "Mul", "Div", "Mod",
+	"Set", "If", "Return",
+	"a Jump, but you don't need this \'goto\' function before the label name.",
+	"Label"
 };
 
-const std::unordered_map<std::string, operation> builtin = {
-	{"Print", operation::Print},
-	{"Println", operation::Println},
-	{"Readln", operation::Readln},
-	{"If", operation::If},
-	{"Error", operation::Error},
-	{"Return", operation::Return},
-	{"Gc", operation::Gc},
+#define ESMEL_OP(name, op) {name, keyword_kind::builtin, static_cast<uint32_t>(operation::op)}
+#define ESMEL_VAR_OP(name, op) {name, keyword_kind::vari_only, static_cast<uint32_t>(operation::op)}
+#define ESMEL_CALL_OP(name, op) {name, keyword_kind::call_only, static_cast<uint32_t>(operation::op)}
+#define ESMEL_TYPE(name, t) {name, keyword_kind::type, static_cast<uint32_t>(Type::t)}
+#define ESMEL_INVALID(name, hint) {name, keyword_kind::invalid, hint}
+
+// 所有关键字、运算符与类型名
+constexpr esmel_keyword keywords[] = {
+	ESMEL_TYPE("Int", INT),
+	ESMEL_TYPE("Float", FLOAT),
+	ESMEL_TYPE("Boolean", BOOLEAN),
+	ESMEL_TYPE("String", STRING),
+	ESMEL_TYPE("Array", ARRAY),
+	ESMEL_TYPE("UndefinedType", UNDEFINED),
+	ESMEL_TYPE("Type", TYPE),
+
+	{"True", keyword_kind::literal, static_cast<uint32_t>(operation::CreateBoolean)},
+	{"False", keyword_kind::literal, static_cast<uint32_t>(operation::CreateBoolean)},
+	{"Undefined", keyword_kind::literal, static_cast<uint32_t>(operation::CreateUndefined)},
+
+	ESMEL_VAR_OP("Add", AddBy),
+	ESMEL_VAR_OP("Sub", SubBy),
+	ESMEL_VAR_OP("Mul", MulBy),
+	ESMEL_VAR_OP("Div", DivBy),
+	ESMEL_VAR_OP("Mod", ModBy),
+	ESMEL_VAR_OP("Set", SetVar),
+	ESMEL_VAR_OP("Input", Input),
+
+	ESMEL_OP("Print", Print),
+	ESMEL_OP("Println", Println),
+	ESMEL_OP("Readln", Readln),
+	ESMEL_OP("If", If),
+	ESMEL_OP("Error", Error),
+	ESMEL_OP("Return", Return),
+	ESMEL_OP("Gc", Gc),
+	ESMEL_OP("Copy", Copy),
 	// 复制算数
-	{"+", operation::Add},
-	{"-", operation::Sub},
-	{"*", operation::Mul},
-	{"/", operation::Sub},
-	{"%", operation::Mod},
-	{"CurrentTime", operation::GetTime},
-	{"TypeOf", operation::Typeof},
-	{"&&", operation::And},
-	{"||", operation::Or},
-	{"!", operation::Not},
-	{"Equal?", operation::Equal},
-	{"==", operation::Equal},
-	{"Less?", operation::Less},
-	{"LessEqual?", operation::ELess},
-	{"GreaterEqual?", operation::EGreater},
-	{"<", operation::Less},
-	{"Greater?", operation::Greater},
-	{">", operation::Greater},
-	{">=", operation::EGreater},
-	{"<=", operation::ELess},
-	{"Or", operation::Or},
-	{"And", operation::And},
-	{"Not", operation::Not},
+	ESMEL_OP("+", Add),
+	ESMEL_OP("-", Sub),
+	ESMEL_OP("*", Mul),
+	ESMEL_OP("/", Div),
+	ESMEL_OP("%", Mod),
+	ESMEL_OP("CurrentTime", GetTime),
+	ESMEL_OP("TypeOf", Typeof),
+	ESMEL_OP("&&", And),
+	ESMEL_OP("||", Or),
+	ESMEL_OP("!", Not),
+	ESMEL_OP("Equal?", Equal),
+	ESMEL_OP("==", Equal),
+	ESMEL_OP("Less?", Less),
+	ESMEL_OP("LessEqual?", ELess),
+	ESMEL_OP("GreaterEqual?", EGreater),
+	ESMEL_OP("<", Less),
+	ESMEL_OP("Greater?", Greater),
+	ESMEL_OP(">", Greater),
+	ESMEL_OP(">=", EGreater),
+	ESMEL_OP("<=", ELess),
+	ESMEL_OP("Or", Or),
+	ESMEL_OP("And", And),
+	ESMEL_OP("Not", Not),
 	// 容器（字符串，数组等）
-	{"NewArray", operation::NewArray},
-	{"Put", operation::SetAt},
-	{"Get", operation::GetAt},
-	{"Append", operation::Append},
-	{"Len", operation::GetLength},
-	{"Link", operation::Link},
-};
+	ESMEL_OP("NewArray", NewArray),
+	ESMEL_OP("Put", SetAt),
+	ESMEL_OP("Get", GetAt),
+	ESMEL_OP("Append", Append),
+	ESMEL_OP("Len", GetLength),
+	ESMEL_OP("Link", Link),
+	// 堆统计
+	ESMEL_OP("HeapSize", GetHeapSize),
+	ESMEL_OP("PeakHeapSize", GetPeakHeapSize),
+	// 协程
+	ESMEL_CALL_OP("Spawn", Spawn),
+	ESMEL_OP("Yield", Yield),
+	ESMEL_OP("Await", Await),
+	// 并行
+	ESMEL_CALL_OP("ParallelMap", ParallelMap),
+	ESMEL_CALL_OP("ParallelFor", ParallelFor),
+	// 程序映像
+	ESMEL_OP("Snapshot", Snapshot),
+	// 序列化
+	ESMEL_OP("Serialize", Serialize),
+	ESMEL_OP("Deserialize", Deserialize),
+	// 文件与字符串
+	ESMEL_OP("ReadFile", ReadFile),
+	ESMEL_OP("Substring", Substring),
+	ESMEL_OP("Split", Split),
+	ESMEL_OP("Find", Find),
+	ESMEL_OP("Contains", Contains),
+	ESMEL_OP("Replace", Replace),
+	ESMEL_OP("Trim", Trim),
+	// 排序
+	ESMEL_OP("Sort", Sort),
+	ESMEL_CALL_OP("SortBy", SortBy),
 
-const std::unordered_map<std::string, std::string> invalid = {
-	{"int", "Int"}, {"float", "Float"}, {"boolean", "Boolean"}, {"string", "String"},{"array", "Array"}, {"undefined", "Undefined"},
-	{"add", "Add"}, {"sub", "Sub"}, {"mul", "Mul"}, {"div", "Div"}, {"mod", "Mod"},
-	{"set", "Set"}, {"if", "If"}, {"return", "Return"},
-	{"goto", "a Jump, but you don't need this \'goto\' function before the label name."},
-{"Goto", "a Jump, but you don't need this \'goto\' function before the label name."},
-	{"label", "Label"}
+	ESMEL_INVALID("int", 0), ESMEL_INVALID("float", 1), ESMEL_INVALID("boolean", 2), ESMEL_INVALID("string", 3),
+	ESMEL_INVALID("array", 4), ESMEL_INVALID("undefined", 5),
+	ESMEL_INVALID("add", 6), ESMEL_INVALID("sub", 7), ESMEL_INVALID("mul", 8), ESMEL_INVALID("div", 9), ESMEL_INVALID("mod", 10),
+	ESMEL_INVALID("set", 11), ESMEL_INVALID("if", 12), ESMEL_INVALID("return", 13),
+	ESMEL_INVALID("goto", 14), ESMEL_INVALID("Goto", 14),
+	ESMEL_INVALID("label", 15),
 };
 
+#undef ESMEL_OP
+#undef ESMEL_VAR_OP
+#undef ESMEL_CALL_OP
+#undef ESMEL_TYPE
+#undef ESMEL_INVALID
+
+// 编译期生成的完美哈希表：在 keyword_table_size 个槽位中为每个关键字找到互不冲突的位置，
+// 查找时只需一次哈希和一次字符串比较。
+constexpr size_t keyword_table_size = 1024;
+constexpr size_t keyword_count = std::size(keywords);
+static_assert(keyword_count < keyword_table_size && keyword_count < UINT8_MAX, "keyword table is too small");
+
+constexpr uint32_t keyword_hash(const std::string_view s, const uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	for (const char c: s) {
+		h ^= static_cast<uint8_t>(c);
+		h *= 16777619u;
+	}
+	return (h ^ (h >> 15)) & (keyword_table_size - 1);
+}
+
+constexpr uint32_t find_keyword_seed() {
+	for (uint32_t seed = 0;; seed++) {
+		bool used[keyword_table_size] = {};
+		bool ok = true;
+		for (const auto& k: keywords) {
+			const uint32_t slot = keyword_hash(k.name, seed);
+			if (used[slot]) {
+				ok = false;
+				break;
+			}
+			used[slot] = true;
+		}
+		if (ok) return seed;
+	}
+}
+
+constexpr uint32_t keyword_seed = find_keyword_seed();
+
+constexpr std::array<uint8_t, keyword_table_size> build_keyword_table() {
+	std::array<uint8_t, keyword_table_size> table{};
+	table.fill(UINT8_MAX);
+	for (size_t i = 0; i < keyword_count; i++) {
+		table[keyword_hash(keywords[i].name, keyword_seed)] = static_cast<uint8_t>(i);
+	}
+	return table;
+}
+
+constexpr std::array<uint8_t, keyword_table_size> keyword_table = build_keyword_table();
+
+// 查找关键字，未找到时返回空指针
+constexpr const esmel_keyword* find_keyword(const std::string_view token) {
+	const uint8_t i = keyword_table[keyword_hash(token, keyword_seed)];
+	if (i == UINT8_MAX || keywords[i].name != token) return nullptr;
+	return &keywords[i];
+}
+
+static_assert(find_keyword("Println") && find_keyword("Println")->value == static_cast<uint32_t>(operation::Println));
+static_assert(find_keyword("println") == nullptr);
+
 struct esmel_op_code {
 	operation op;
 	uint64_t data;
@@ -108,14 +240,35 @@ struct esmel_op_code {
 
 
 
+// 结构化循环（While ... End）的位置，均为函数内的行下标
+struct esmel_loop {
+	uint64_t preheader;		// 前置行，循环不变量的缓存在此处清空
+	uint64_t header;		// 循环头，计算条件
+	uint64_t end;			// 回边，跳回循环头
+};
+
+// 参数个数不超过此值的函数才会被缓存返回值
+constexpr uint64_t memo_max_arguments = 4;
+
+// 每个栈帧在局部变量之上至少预留的临时值空间，编译时检查每一行的临时值不超过此值
+constexpr size_t exec_stack_reserve = 256;
+
 class esmel_function {
 public:
 	// 实际信息
 	uint64_t arguments;		// 参数长度
 	uint64_t variable_count;
 	std::vector<std::vector<esmel_op_code>> code;				// Esmel代码
+	bool memoize = false;		// 纯函数且递归：按参数值缓存返回值
+	std::vector<std::vector<uint32_t>> stack_maps;	// 栈图：每行执行中可能仍会被读取的局部变量槽位（升序），为空时 GC 标记所有槽位
 	// 调试信息
 	std::string name;											// 函数名称
 	std::string file_name;								// 位于的文件名
 	std::vector<uint64_t> real_line_num;				// 真实行号
-};
\ No newline at end of file
+	std::vector<esmel_loop> loops;						// 循环结构（供优化使用）
+};
+
+// 尚未编译的函数（按需编译时只有一行 LazyCompile）
+inline bool is_lazy_stub(const esmel_function& func) {
+	return func.code.size() == 1 && func.code[0].size() == 1 && func.code[0][0].op == operation::LazyCompile;
+}
\ No newline at end of file
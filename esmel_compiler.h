@@ -3,15 +3,30 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <bit>
 #include "esmel_callable.h"
+#include "esmel_optimizer.h"
 #include <iostream>
 #include <fstream>
+#include <charconv>
+#include <mutex>
+#include <string_view>
 
 #define main_func_name "Main"
 
 using namespace std;
 
 
+// 支持以 string_view 直接查找的字符串哈希表
+struct string_hash {
+	using is_transparent = void;
+	size_t operator()(const std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+template <class T>
+using symbol_map = unordered_map<string, T, string_hash, std::equal_to<>>;
+
 class esmel_compiler {
 	struct preloaded_code {
 		size_t id{};
@@ -22,13 +37,26 @@ class esmel_compiler {
 		unordered_map<string, uint64_t> temp_variable_record;
 		unordered_map<string, uint64_t> temp_labels_record;
 		std::vector<std::vector<std::string>> code;
+		std::vector<esmel_loop> loops;
 		std::unordered_set<std::string> keywords;
+		bool defined = false;		// 由 Function 定义（Main 也可以直接写在文件开头）
+		std::vector<std::pair<uint64_t, string>> pending_lines;	// 按需编译：尚未分词的函数体 (行下标, 原文)
 	};
 public:
 	vector<esmel_function> esmel_functions;
-	unordered_map<string, preloaded_code> preloaded_codes;
-	std::unordered_map<std::string, uint64_t> static_strs_record;
+	symbol_map<preloaded_code> preloaded_codes;
+	symbol_map<uint64_t> static_strs_record;
 	std::vector<std::string> static_strs;
+	std::vector<uint64_t> function_arity;		// 函数id -> 参数个数
+	// 模块模式：找不到的函数名不报错，而是记为导入（id 为 preloaded_codes.size() + 导入下标），由链接器解析。
+	// 需要知道被调用函数的优化也推迟到链接之后。
+	bool allow_imports = false;
+	std::vector<std::string> imports;
+	// 按需编译：add_target 只分词 Function 行、记下函数的边界，compile 为每个函数生成一行 LazyCompile 桩，
+	// 函数第一次被调用时由 compile_lazily 编译。编译期的错误推迟到调用时报告；需要整个程序的缓存纯函数不进行。
+	bool lazy = false;
+	std::mutex lazy_mutex;						// 并行工作线程可能同时编译
+	std::vector<preloaded_code*> sources;		// 函数id -> 源代码
 
 	esmel_compiler() {
 		preloaded_codes = {
@@ -39,43 +67,40 @@ public:
 	static vector<string> splitLine(const string &line, int line_num)
 	{
 		vector<string> tokens;
-		string current_token;
+		size_t token_start = string::npos;	// 当前记号的起始位置
 		bool in_quotes = false;
-		int quote_start_pos = -1;
+		size_t quote_start_pos = 0;
 
-		for (size_t i = 0; i < line.length(); ++i)
+		size_t i = 0;
+		for (; i < line.length(); ++i)
 		{
-			char c = line[i];
+			const char c = line[i];
 
 			if (c == '"')
 			{
-				if (!in_quotes)
-				{
-					// 开始引号
-					quote_start_pos = i;
-				}
-				else
-				{
-					// 结束引号
-					quote_start_pos = -1;
-				}
+				// 开始或结束引号
+				if (!in_quotes) quote_start_pos = i;
 				in_quotes = !in_quotes;
-				current_token += c;
+				if (token_start == string::npos) token_start = i;
 			}
-			else if (std::isspace(c) && !in_quotes)
+			else if (in_quotes)
 			{
-				if (!current_token.empty())
+				continue;
+			}
+			else if (std::isspace(static_cast<unsigned char>(c)))
+			{
+				if (token_start != string::npos)
 				{
-					tokens.push_back(current_token);
-					current_token.clear();
+					tokens.emplace_back(line, token_start, i - token_start);
+					token_start = string::npos;
 				}
 			}
-			else if (c == '#' && !in_quotes) {
+			else if (c == '#') {
 				break;
 			}
-			else
+			else if (token_start == string::npos)
 			{
-				current_token += c;
+				token_start = i;
 			}
 		}
 
@@ -86,17 +111,35 @@ public:
 			exit(-1);
 		}
 
-		if (!current_token.empty())
+		if (token_start != string::npos)
 		{
-			tokens.push_back(current_token);
+			tokens.emplace_back(line, token_start, i - token_start);
 		}
 
 		return tokens;
 	}
 
-	static vector<vector<string>> splitLinesFromFile(const string &filename)
+	// 字符串字面量中的转义：\n 换行，\t 制表符，\\ 反斜杠；其它的反斜杠原样保留
+	static string unescape(const std::string_view literal) {
+		string result;
+		result.reserve(literal.size());
+		for (size_t i = 0; i < literal.size(); i++) {
+			if (literal[i] == '\\' && i + 1 < literal.size()) {
+				const char next = literal[i + 1];
+				if (next == 'n' || next == 't' || next == '\\') {
+					result += next == 'n' ? '\n' : next == 't' ? '\t' : '\\';
+					i++;
+					continue;
+				}
+			}
+			result += literal[i];
+		}
+		return result;
+	}
+
+	static vector<string> readLinesFromFile(const string &filename)
 	{
-		vector<vector<string> > result;
+		vector<string> result;
 		std::ifstream file(filename);
 
 		if (!file.is_open())
@@ -106,184 +149,400 @@ public:
 		}
 
 		string line;
-		int line_num = 0;
-
 		while (std::getline(file, line))
 		{
-			result.push_back(splitLine(line, line_num));
-			line_num++;
+			result.push_back(std::move(line));
 		}
 
 		file.close();
 		return result;
 	}
 
+	// 行首的记号是否为 Function（不分词整行）
+	static bool startsFunction(const string &line)
+	{
+		const size_t start = line.find_first_not_of(" \t\r\v\f");
+		return start != string::npos && line.compare(start, 8, "Function") == 0
+			&& (start + 8 == line.size() || std::isspace(static_cast<unsigned char>(line[start + 8])));
+	}
+
+	static void checkLoopsClosed(const string &name, const preloaded_code &code, const std::vector<esmel_loop> &open_loops)
+	{
+		if (!open_loops.empty()) {
+			std::cerr << "Error: Unclosed While loop in function '" << name << "' (missing End).\n\tat " << code.file_name << ':'
+				<< code.real_line_num[open_loops.back().header] << std::endl;
+			exit(0);
+		}
+	}
+
+	// 将函数体的一行（第 i 行，已分词）加入函数 code：处理 Label、While 与 End
+	static void preloadLine(preloaded_code &code, vector<string> &tokens, const uint64_t i, std::vector<esmel_loop> &open_loops)
+	{
+		const string &filename = code.file_name;
+		if (tokens[0] == "Label") {
+			if (tokens.size() != 2) {
+				std::cerr << "Error: Illegal label defined.\n\tat file " << filename << ':' << i+1 << std::endl;
+				exit(0);
+			}
+			if (code.keywords.contains(tokens[1])) {
+				std::cerr << "Error: Redefined keyword \'" << tokens[1] << "\'\n\tat " << filename << ':' << i+1 << std::endl;
+				exit(0);
+			}
+			if (!std::isupper(tokens[1][0])) {
+				std::cerr << "Error: Label name must be started a uppercase letter. (Consider using \'" << static_cast<char>(std::toupper(tokens[1][0]))
+					<< tokens[1].substr(1) << "\')\n\tat " << filename << ':' << i+1 << std::endl;
+				exit(0);
+			}
+			code.temp_labels_record[tokens[1]] = code.code.size();
+			code.keywords.insert(tokens[1]);
+		} else if (tokens[0] == "While") {
+			if (tokens.size() < 2) {
+				std::cerr << "Error: While without a condition.\n\tat " << filename << ':' << i+1 << std::endl;
+				exit(0);
+			}
+			// While cond 展开为一个空的前置行与一个循环头（条件 + GotoUnless），
+			// 对应的 End 展开为跳回循环头的回边。
+			code.code.emplace_back();
+			code.real_line_num.push_back(i+1);
+			open_loops.push_back({code.code.size() - 1, code.code.size(), 0});
+			tokens.erase(tokens.begin());
+			code.code.push_back(std::move(tokens));
+			code.real_line_num.push_back(i+1);
+		} else if (tokens.size() == 1 && tokens[0] == "End" && !open_loops.empty()) {
+			// 循环内单独的 End 关闭最内层的 While；循环外仍可作为标签名使用
+			esmel_loop loop = open_loops.back();
+			open_loops.pop_back();
+			loop.end = code.code.size();
+			code.loops.push_back(loop);
+			code.code.emplace_back();
+			code.real_line_num.push_back(i+1);
+		} else {
+			code.code.push_back(std::move(tokens));
+			code.real_line_num.push_back(i+1);
+		}
+	}
 
 	void add_target(string &filename) {
 		// 将一个目标Esmel源代码文件加入预编译。
-		auto parsed = splitLinesFromFile(filename);
+		auto lines = readLinesFromFile(filename);
 		// 目前的函数名
 		string current = main_func_name;
-		for (uint64_t i = 0; i < parsed.size(); i++) {
-			if (parsed[i].empty()) continue;
-			if (parsed[i][0] == "Function") {
-				if (parsed[i].size() < 2) {
+		preloaded_code* current_code = &preloaded_codes[current];
+		if (current_code->file_name.empty()) current_code->file_name = filename;
+		// 尚未遇到 End 的 While 循环
+		std::vector<esmel_loop> open_loops;
+		for (uint64_t i = 0; i < lines.size(); i++) {
+			// 按需编译时函数体的行原样保存，编译时再分词
+			if (lazy && !startsFunction(lines[i])) {
+				current_code->pending_lines.emplace_back(i, std::move(lines[i]));
+				continue;
+			}
+			auto tokens = splitLine(lines[i], static_cast<int>(i));
+			if (tokens.empty()) continue;
+			if (tokens[0] == "Function") {
+				checkLoopsClosed(current, *current_code, open_loops);
+				if (tokens.size() < 2) {
 					std::cerr << "Error: Empty function defined.\n\tat " << filename << ':' << i+1 << std::endl;
 					exit(0);
 				}
-				if (!std::isupper(parsed[i][1][0])) {
-					std::cerr << "Error: Function name must be started a uppercase letter. (Consider using \'" << static_cast<char>(std::toupper(parsed[i][1][0]))
-							<< parsed[i][1].substr(1) << "\')\n\tat " << filename << ':' << i+1 << std::endl;
+				if (!std::isupper(tokens[1][0])) {
+					std::cerr << "Error: Function name must be started a uppercase letter. (Consider using \'" << static_cast<char>(std::toupper(tokens[1][0]))
+							<< tokens[1].substr(1) << "\')\n\tat " << filename << ':' << i+1 << std::endl;
 					exit(0);
 				}
-				auto t = preloaded_codes.find(parsed[i][1]);
+				auto t = preloaded_codes.find(tokens[1]);
 				if (t == preloaded_codes.end()) {
 					// 新定义函数则分配一个id
-					preloaded_codes.insert({parsed[i][1], {preloaded_codes.size()}});
+					preloaded_codes.insert({tokens[1], {preloaded_codes.size()}});
 				} else {
-					preloaded_codes[parsed[i][1]].temp_variable_record.clear();
-					preloaded_codes[parsed[i][1]].code.clear();
-					preloaded_codes[parsed[i][1]].temp_labels_record.clear();
-					preloaded_codes[parsed[i][1]].real_line_num.clear();
+					t->second.temp_variable_record.clear();
+					t->second.code.clear();
+					t->second.temp_labels_record.clear();
+					t->second.real_line_num.clear();
+					t->second.loops.clear();
+					t->second.pending_lines.clear();
 				}
-				current = parsed[i][1];
-				preloaded_codes[current].name = current;
-				preloaded_codes[current].file_name = filename;
-				preloaded_codes[current].arguments = parsed[i].size() - 2;
-				preloaded_codes[current].keywords.insert(current);
-				for (size_t j=parsed[i].size()-1; j>=2; j--) {
-					if (preloaded_codes[current].keywords.contains(parsed[i][j])) {
-						std::cerr << "Error: Redefined keyword \'" << parsed[i][j] << "\'\n\tat file " << filename << ':' << i+1 << std::endl;
+				current = tokens[1];
+				current_code = &preloaded_codes[current];
+				current_code->defined = true;
+				current_code->name = current;
+				current_code->file_name = filename;
+				current_code->arguments = tokens.size() - 2;
+				current_code->keywords.insert(current);
+				for (size_t j=tokens.size()-1; j>=2; j--) {
+					if (current_code->keywords.contains(tokens[j])) {
+						std::cerr << "Error: Redefined keyword \'" << tokens[j] << "\'\n\tat file " << filename << ':' << i+1 << std::endl;
 						exit(0);
 					}
-					preloaded_codes[current].temp_variable_record[parsed[i][j]] = preloaded_codes[current].temp_variable_record.size();
-					preloaded_codes[current].keywords.insert(parsed[i][j]);
-				}
-			} else if (parsed[i][0] == "Label") {
-				if (parsed[i].size() != 2) {
-					std::cerr << "Error: Illegal label defined.\n\tat file " << filename << ':' << i+1 << std::endl;
-					exit(0);
-				}
-				if (preloaded_codes[current].keywords.contains(parsed[i][1])) {
-					std::cerr << "Error: Redefined keyword \'" << parsed[i][1] << "\'\n\tat " << filename << ':' << i+1 << std::endl;
-					exit(0);
-				}
-				if (!std::isupper(parsed[i][1][0])) {
-					std::cerr << "Error: Label name must be started a uppercase letter. (Consider using \'" << static_cast<char>(std::toupper(parsed[i][1][0]))
-						<< parsed[i][1].substr(1) << "\')\n\tat " << filename << ':' << i+1 << std::endl;
-					exit(0);
+					current_code->temp_variable_record[tokens[j]] = current_code->temp_variable_record.size();
+					current_code->keywords.insert(tokens[j]);
 				}
-				preloaded_codes[current].temp_labels_record[parsed[i][1]] = preloaded_codes[current].code.size();
-				preloaded_codes[current].keywords.insert(parsed[i][1]);
 			} else {
-				preloaded_codes[current].code.push_back(parsed[i]);
-				preloaded_codes[current].real_line_num.push_back(i+1);
+				preloadLine(*current_code, tokens, i, open_loops);
 			}
 		}
+		checkLoopsClosed(current, *current_code, open_loops);
 	}
 
-	void compile()
+	// 按需编译：分词并处理推迟的函数体
+	static void preloadPending(const string &name, preloaded_code &code)
 	{
-		// 编译
-		esmel_functions = vector<esmel_function>(preloaded_codes.size());
-		for (const auto& i: preloaded_codes) {
-			unordered_map<string, uint64_t> temp_variable_record = i.second.temp_variable_record;
-			unordered_map<string, uint64_t> temp_labels_record = i.second.temp_labels_record;
-			esmel_function current_func = esmel_function();
-			current_func.real_line_num = i.second.real_line_num;
-			current_func.arguments = i.second.arguments;
-			current_func.name = i.second.name;
-			current_func.file_name = i.second.file_name;
-			current_func.variable_count = i.second.arguments;
-			for (size_t j = 0; j < i.second.code.size(); j++) {
-				current_func.code.emplace_back();
-				for (auto it = i.second.code[j].rbegin(); it != i.second.code[j].rend(); ++it) {
-					string token = *it;
-					if (token.length() >= 2 && token[0] == '\"' && token[token.size()-1] == '\"') {
-						// 字符串。
-						token = token.substr(1, token.length() - 2);
-						if (static_strs_record.find(token) == static_strs_record.end()) {
-							// 添加字符串字面量。
-							static_strs_record[token] = static_strs_record.size();
-						}
-						current_func.code.back().push_back({operation::GetStaticStr, static_strs_record[token]});
+		std::vector<esmel_loop> open_loops;
+		for (auto& [i, line]: code.pending_lines) {
+			auto tokens = splitLine(line, static_cast<int>(i));
+			if (!tokens.empty()) preloadLine(code, tokens, i, open_loops);
+		}
+		code.pending_lines.clear();
+		checkLoopsClosed(name, code, open_loops);
+	}
+
+	// 单遍分类：根据首字符与一次完美哈希查找确定记号的种类，数字只解析一次。
+	enum class token_class: uint8_t {
+		string_literal, keyword, integer, floating, name
+	};
+
+	struct classified_token {
+		token_class cls;
+		const esmel_keyword* keyword = nullptr;
+		uint64_t data = 0;		// 整数或浮点数的位模式
+	};
+
+	static classified_token classify(const std::string_view token) {
+		if (token.size() >= 2 && token.front() == '\"' && token.back() == '\"') {
+			return {token_class::string_literal};
+		}
+		if (const esmel_keyword* k = find_keyword(token)) {
+			return {token_class::keyword, k};
+		}
+		const char c = token[0];
+		// 以 i、n 开头的可能是 inf、infinity、nan（不区分大小写），同样按浮点数解析
+		if (std::isdigit(static_cast<unsigned char>(c)) || ((c == '-' || c == '.') && token.size() > 1)
+			|| c == 'i' || c == 'I' || c == 'n' || c == 'N') {
+			// 仅含数字（及开头的负号）时按整数解析，溢出或含其它字符时按浮点数解析
+			bool integral = true;
+			for (size_t i = c == '-' ? 1 : 0; i < token.size(); i++) {
+				if (!std::isdigit(static_cast<unsigned char>(token[i]))) {
+					integral = false;
+					break;
+				}
+			}
+			const char* end = token.data() + token.size();
+			if (integral) {
+				int64_t value;
+				auto [ptr, ec] = std::from_chars(token.data(), end, value);
+				if (ec == std::errc() && ptr == end) return {token_class::integer, nullptr, std::bit_cast<uint64_t>(value)};
+			}
+			double value;
+			auto [ptr, ec] = std::from_chars(token.data(), end, value);
+			if (ec == std::errc() && ptr == end) return {token_class::floating, nullptr, std::bit_cast<uint64_t>(value)};
+		}
+		return {token_class::name};
+	}
+
+	// 函数内的符号表：标签、局部变量，以及已解析过的函数名
+	enum class symbol_kind: uint8_t {
+		variable, label, function
+	};
+
+	struct symbol {
+		symbol_kind kind;
+		uint64_t id;
+	};
+
+	esmel_function compile_function(const preloaded_code& source)
+	{
+		symbol_map<symbol> symbols;
+		symbols.reserve(source.temp_labels_record.size() + source.temp_variable_record.size() + 16);
+		for (const auto& [name, id]: source.temp_labels_record) symbols.emplace(name, symbol{symbol_kind::label, id});
+		for (const auto& [name, id]: source.temp_variable_record) symbols.emplace(name, symbol{symbol_kind::variable, id});
+
+		esmel_function current_func = esmel_function();
+		current_func.real_line_num = source.real_line_num;
+		current_func.arguments = source.arguments;
+		current_func.name = source.name;
+		current_func.file_name = source.file_name;
+		current_func.variable_count = source.temp_variable_record.size();
+		current_func.loops = source.loops;
+		current_func.code.reserve(source.code.size());
+
+		for (size_t j = 0; j < source.code.size(); j++) {
+			auto& line = current_func.code.emplace_back();
+			line.reserve(source.code[j].size());
+			for (auto it = source.code[j].rbegin(); it != source.code[j].rend(); ++it) {
+				const std::string_view token = *it;
+				const classified_token t = classify(token);
+				switch (t.cls) {
+				case token_class::string_literal: {
+					// 字符串。
+					const std::string content = unescape(token.substr(1, token.length() - 2));
+					auto found = static_strs_record.find(content);
+					if (found == static_strs_record.end()) {
+						// 添加字符串字面量。
+						found = static_strs_record.emplace(content, static_strs_record.size()).first;
+						static_strs.push_back(content);
 					}
-					// // 结构符（应该总是在行初遇到）
-					// else if (token == "While") {
-					// 	current_func.code.back().push_back({operation::Goto, -1});
-					// }
-					// else if (token == "End") {
-					//
-					// }
-
-					// 布尔值。
-					else if (token == "True") current_func.code.back().emplace_back(operation::CreateBoolean, true);
-					else if (token == "False") current_func.code.back().emplace_back(operation::CreateBoolean, false);
-					else if (token == "Undefined") current_func.code.back().emplace_back(operation::CreateUndefined, 0);
-					else if (builtin.contains(token)) {
-						current_func.code.back().push_back({builtin.at(token), 0});
-					} else if (vari_only_builtin.contains(token)) {
+					line.push_back({operation::GetStaticStr, found->second});
+					break;
+				}
+				case token_class::keyword: {
+					const esmel_keyword& k = *t.keyword;
+					switch (k.kind) {
+					case keyword_kind::builtin:
+						line.push_back({static_cast<operation>(k.value), 0});
+						break;
+					case keyword_kind::vari_only:
 						// 特殊：Set操作
-						if (current_func.code.back().back().op != operation::GetVar) {
-							cerr << "Illegal " << token << ". This method can only be used on variables.\n\tat " << i.second.file_name << ':' << i.second.real_line_num[j];
+						if (line.empty() || line.back().op != operation::GetVar) {
+							cerr << "Illegal " << token << ". This method can only be used on variables.\n\tat " << source.file_name << ':' << source.real_line_num[j];
 							exit(-1);
 						}
-						current_func.code.back().back() = {vari_only_builtin.at(token), current_func.code.back().back().data};
-					} else if (types.contains(token)){
-						current_func.code.back().emplace_back(operation::CreateType, std::bit_cast<int32_t>(types.at(token)));
-					}else {
-						// 尝试解析为整数
-						long long llvalue;
-						auto [ptr, ec] = std::from_chars(token.data(), token.data()+token.size(), llvalue);
-						if (ec == std::errc() && ptr == token.data() + token.size()) {
-							current_func.code.back().push_back({operation::CreateInt, std::bit_cast<uint64_t>(llvalue)});
-						} else {
-							// 浮点数
-							double dbvalue;
-							auto [ptr2, ec2] = std::from_chars(token.data(), token.data()+token.size(), dbvalue);
-							if (ec2 == std::errc() && ptr2 == token.data() + token.size()) {
-								// std::cout << "good " << dbvalue;
-								current_func.code.back().push_back({operation::CreateFloat, std::bit_cast<uint64_t>(dbvalue)});
-							}
-							// 运行时变量 或 label
-							else if (temp_labels_record.find(token) != temp_labels_record.end()) {
-								// 如果这是一个label。
-								current_func.code.back().push_back({operation::Goto, temp_labels_record.at(token)});
-							} else {
-								if (std::isupper(token[0])) {
-									// 开头大写，作为函数解析
-									if (preloaded_codes.find(token) == preloaded_codes.end()) {
-										// 未找到函数则报错
-										cerr << "Cannot find function or label \'" << token << "\'. If you means a variable, consider using a lowercase letter started word." << "(Like \'"
-											<< static_cast<char>(std::tolower(token[0])) << token.substr(1) << "\')\n\tat " << i.second.file_name << ':' << i.second.real_line_num[j];
-										exit(-1);
-									}
-									// 如果是Esmel函数
-									current_func.code.back().push_back({operation::Call, preloaded_codes[token].id});
-								} else {
-									// 否则判定为运行时变量。
-									if (invalid.contains(token)) {
-										cerr << "\'" << token << "\' is an invalid variable name. Perhaps you mean " << invalid.at(token) << std::endl;
-										cerr << "\tat " << i.second.file_name << ':' << i.second.real_line_num[j];
-									} else {
-										if (temp_variable_record.find(token) == temp_variable_record.end()) {
-											// 第一次遇见此变量，则为此变量分配一个ID。
-											temp_variable_record[token] = temp_variable_record.size();
-											current_func.variable_count += 1;
-										}
-										current_func.code.back().push_back({operation::GetVar, temp_variable_record[token]});
-									}
+						line.back() = {static_cast<operation>(k.value), line.back().data};
+						break;
+					case keyword_kind::call_only:
+						// 特殊：Spawn 作用于紧随其后的函数调用
+						if (line.empty() || line.back().op != operation::Call) {
+							cerr << "Illegal " << token << ". This method can only be used on function calls.\n\tat " << source.file_name << ':' << source.real_line_num[j];
+							exit(-1);
+						}
+						line.back().op = static_cast<operation>(k.value);
+						// 并行调用与求排序键的函数只接收一个元素
+						if ((line.back().op == operation::ParallelMap || line.back().op == operation::ParallelFor
+							|| line.back().op == operation::SortBy)
+							&& line.back().data < function_arity.size() && function_arity[line.back().data] != 1) {
+							cerr << token << " needs a function that takes exactly 1 argument.\n\tat " << source.file_name << ':' << source.real_line_num[j];
+							exit(-1);
+						}
+						break;
+					case keyword_kind::type:
+						line.push_back({operation::CreateType, k.value});
+						break;
+					case keyword_kind::literal:
+						// 布尔值。
+						if (token == "True") line.push_back({operation::CreateBoolean, true});
+						else if (token == "False") line.push_back({operation::CreateBoolean, false});
+						else line.push_back({operation::CreateUndefined, 0});
+						break;
+					case keyword_kind::invalid:
+						cerr << "\'" << token << "\' is an invalid variable name. Perhaps you mean " << invalid_hints[k.value] << std::endl;
+						cerr << "\tat " << source.file_name << ':' << source.real_line_num[j];
+						exit(-1);
+					}
+					break;
+				}
+				case token_class::integer:
+					line.push_back({operation::CreateInt, t.data});
+					break;
+				case token_class::floating:
+					line.push_back({operation::CreateFloat, t.data});
+					break;
+				case token_class::name: {
+					auto found = symbols.find(token);
+					if (found == symbols.end()) {
+						if (std::isupper(static_cast<unsigned char>(token[0]))) {
+							// 开头大写，作为函数解析
+							const auto func = preloaded_codes.find(token);
+							if (func == preloaded_codes.end() && allow_imports) {
+								const auto imported = std::ranges::find(imports, token);
+								found = symbols.emplace(token, symbol{symbol_kind::function,
+									preloaded_codes.size() + static_cast<uint64_t>(imported - imports.begin())}).first;
+								if (imported == imports.end()) imports.emplace_back(token);
+							} else if (func == preloaded_codes.end()) {
+								// 其次查找注册的原生函数
+								const uint64_t native = esmel_find_native(token);
+								if (native != UINT64_MAX) {
+									line.push_back({operation::CallNative, native});
+									break;
 								}
+								// 未找到函数则报错
+								cerr << "Cannot find function or label \'" << token << "\'. If you means a variable, consider using a lowercase letter started word." << "(Like \'"
+									<< static_cast<char>(std::tolower(token[0])) << token.substr(1) << "\')\n\tat " << source.file_name << ':' << source.real_line_num[j];
+								exit(-1);
+							} else {
+								found = symbols.emplace(token, symbol{symbol_kind::function, func->second.id}).first;
 							}
+						} else {
+							// 第一次遇见此变量，则为此变量分配一个ID。
+							found = symbols.emplace(token, symbol{symbol_kind::variable, current_func.variable_count++}).first;
 						}
 					}
+					switch (found->second.kind) {
+					case symbol_kind::label:
+						line.push_back({operation::Goto, found->second.id});
+						break;
+					case symbol_kind::function:
+						line.push_back({operation::Call, found->second.id});
+						break;
+					case symbol_kind::variable:
+						line.push_back({operation::GetVar, found->second.id});
+						break;
+					}
+					break;
+				}
 				}
 			}
-			esmel_functions[i.second.id] = current_func;
+			// 行内的临时值必须放得进栈帧预留的空间
+			if (max_stack_depth(line, function_arity) > exec_stack_reserve) {
+				cerr << "Expression is too deeply nested: at most " << exec_stack_reserve << " pending values are allowed in one line.\n\tat "
+					<< source.file_name << ':' << source.real_line_num[j];
+				exit(-1);
+			}
+		}
+		// 循环头在条件之后判断是否跳出，End 跳回循环头
+		for (const auto& loop: current_func.loops) {
+			current_func.code[loop.header].push_back({operation::GotoUnless, loop.end + 1});
+			current_func.code[loop.end].push_back({operation::Goto, loop.header});
+		}
+		return current_func;
+	}
+
+	// 按需编译的函数在第一次调用前的代码：只有一行 LazyCompile，参数之外没有局部变量
+	static esmel_function lazy_stub(const preloaded_code& source)
+	{
+		esmel_function stub;
+		stub.name = source.name;
+		stub.file_name = source.file_name;
+		stub.arguments = source.arguments;
+		stub.variable_count = source.arguments;
+		stub.real_line_num = {source.pending_lines.empty() ? 0 : source.pending_lines.front().first + 1};
+		stub.code = {{{operation::LazyCompile, source.id}}};
+		return stub;
+	}
+
+	// 编译函数 id（只编译一次），并把此后新增的字符串字面量追加到 strs（调用者的字符串池）末尾
+	esmel_function compile_lazily(const uint32_t id, std::vector<std::string>& strs)
+	{
+		std::lock_guard lock(lazy_mutex);
+		esmel_function& func = esmel_functions[id];
+		if (is_lazy_stub(func)) {
+			preloaded_code& source = *sources[id];
+			preloadPending(source.name.empty() ? main_func_name : source.name, source);
+			func = compile_function(source);
+			eliminate_bounds_checks(func);
+			optimize_function(func, function_arity);
+		}
+		strs.insert(strs.end(), static_strs.begin() + static_cast<std::ptrdiff_t>(strs.size()), static_strs.end());
+		return func;
+	}
+
+	void compile()
+	{
+		function_arity = std::vector<uint64_t>(preloaded_codes.size());
+		for (const auto& i: preloaded_codes) function_arity[i.second.id] = i.second.arguments;
+		esmel_functions = vector<esmel_function>(preloaded_codes.size());
+		if (lazy) {
+			sources.resize(preloaded_codes.size());
+			for (auto& i: preloaded_codes) {
+				sources[i.second.id] = &i.second;
+				esmel_functions[i.second.id] = lazy_stub(i.second);
+			}
+			return;
 		}
-		static_strs.resize(static_strs_record.size());
-		for (const auto& [i, j] : static_strs_record) {
-			static_strs[j] = i;
+		// 编译
+		for (const auto& i: preloaded_codes) {
+			esmel_functions[i.second.id] = compile_function(i.second);
 		}
+		// 优化：消除下标检查只需要函数自身；其余的优化要知道被调用函数的参数个数，模块在链接后进行
+		for (auto& func: esmel_functions) eliminate_bounds_checks(func);
+		if (!allow_imports) optimize_program(esmel_functions);
 	}
-};
\ No newline at end of file
+};
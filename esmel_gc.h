@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
+#include "esmel_alloc_profiler.h"
 #include "esmel_object.h"
+#include "esmel_stats.h"
 
 
 class EsmelObjectPool {
@@ -12,31 +17,260 @@ class EsmelObjectPool {
     std::vector<esmel_array*> all_arrays;
 
 public:
-    // 创建对象并添加到池中
-    EsmelObject createString(const std::string& val) {
+    // 栈帧区域：编译期证明不会逃出栈帧的对象分配在当前调用深度的区域中，函数返回时整体释放。
+    // 区域中的对象同样参与标记与清除，因此长时间运行的循环中的临时对象仍能被自动回收。
+    struct region {
+        std::vector<esmel_string*> strings;
+        std::vector<esmel_array*> arrays;
+    };
+
+    // 一个执行上下文的区域栈，下标为调用深度
+    struct region_stack {
+        std::vector<region> regions = std::vector<region>(1);
+        size_t current = 0;
+    };
+
+private:
+    // 所有执行上下文（主程序与各协程）的区域栈，回收时一并清除
+    std::vector<region_stack*> region_stacks;
+    region_stack main_regions;
+    region_stack* active_regions = &main_regions;
+
+public:
+    // 堆统计（字节）。每个对象计入其头部、自身持有的缓冲区以及池中的一个指针。
+    uint64_t live_bytes = 0;                    // 当前堆大小
+    uint64_t peak_bytes = 0;                    // 历史峰值
+    // GC节奏：堆大小超过 gc_threshold 时自动回收，回收后阈值设为 存活字节数 * gc_growth。
+    uint64_t heap_limit = 0;                    // 堆大小硬上限，0表示不限制
+    double gc_growth = 2.0;                     // 增长因子，不大于0表示关闭自动回收（由 set_gc_growth 设置）
+    uint64_t gc_min_threshold = 8 << 20;        // 自动回收阈值的下限
+    uint64_t gc_threshold = 8 << 20;
+    uint16_t heap_id = 0;                       // 堆编号：0为主堆，并行工作线程各有自己的堆
+    EsmelAllocProfiler* alloc_profiler = nullptr;   // 内存分析器（为空表示未开启）
+
+    EsmelObjectPool() {
+        region_stacks.push_back(&main_regions);
+    }
+    EsmelObjectPool(const EsmelObjectPool&) = delete;
+    EsmelObjectPool& operator=(const EsmelObjectPool&) = delete;
+
+    // 设置增长因子。不大于 0 时关闭自动回收，阈值立即设为无穷大（设置了 heap_limit 时仍在达到上限时回收）
+    void set_gc_growth(const double growth) {
+        gc_growth = growth;
+        gc_threshold = growth > 0 ? gc_min_threshold : UINT64_MAX;
+        if (heap_limit) gc_threshold = std::min(gc_threshold, heap_limit);
+    }
+
+    ~EsmelObjectPool() {
+        for (const auto* s: all_strings) delete s;
+        for (const auto* a: all_arrays) delete a;
+        for (auto* stack: region_stacks) {
+            for (const auto& r: stack->regions) {
+                for (const auto* s: r.strings) delete s;
+                for (const auto* a: r.arrays) delete a;
+            }
+            if (stack != &main_regions) delete stack;
+        }
+    }
+
+    // 共享的缓冲区按共享者数量平摊，从而在总量中只计一次
+    static uint64_t size_of(const esmel_string* s) {
+        const uint64_t buffer = s->shared
+            ? (string_heap_bytes(*s->shared) + s->shared.use_count() - 1) / s->shared.use_count()
+            : string_heap_bytes(s->v);
+        return sizeof(esmel_string) + sizeof(esmel_string*) + buffer;
+    }
+
+    static uint64_t size_of(const esmel_array* a) {
+        const uint64_t buffer = a->shared
+            ? (a->shared->capacity() * sizeof(EsmelObject) + a->shared.use_count() - 1) / a->shared.use_count()
+            : a->v.capacity() * sizeof(EsmelObject);
+        return sizeof(esmel_array) + sizeof(esmel_array*) + buffer;
+    }
+
+    // 记录已有对象的内存增长（如 Append 导致数组扩容）
+    void grow(const int64_t bytes) {
+        live_bytes += bytes;
+        peak_bytes = std::max(peak_bytes, live_bytes);
+    }
+
+    // 数组容量变化后调用
+    void resized(const esmel_array* a, const size_t old_capacity) {
+        if (a->v.capacity() != old_capacity) {
+            grow(static_cast<int64_t>((a->v.capacity() - old_capacity) * sizeof(EsmelObject)));
+            if (alloc_profiler && a->v.capacity() > old_capacity) [[unlikely]] {
+                alloc_profiler->grew((a->v.capacity() - old_capacity) * sizeof(EsmelObject));
+            }
+        }
+    }
+
+    // 取得可修改的数组元素；若与副本共享，复制出的新缓冲区计入堆大小
+    std::vector<EsmelObject>& writable(esmel_array* a) {
+        const bool copies = a->shared && a->shared.use_count() > 1;
+        auto& v = a->write();
+        if (copies) [[unlikely]] {
+            grow(static_cast<int64_t>(v.capacity() * sizeof(EsmelObject)));
+            if (alloc_profiler) alloc_profiler->grew(v.capacity() * sizeof(EsmelObject));
+        }
+        return v;
+    }
+
+    // 计入在池外发生的增长（绳展平）
+    void sync() {
+        if (esmel_untracked_bytes != 0) {
+            grow(esmel_untracked_bytes);
+            esmel_untracked_bytes = 0;
+        }
+    }
+
+    // 是否应当进行一次自动回收
+    [[nodiscard]] bool over_threshold() const {
+        return live_bytes + esmel_untracked_bytes > gc_threshold;
+    }
+
+    // 为新的执行上下文（协程）创建区域栈
+    region_stack* create_region_stack() {
+        region_stacks.push_back(new region_stack());
+        return region_stacks.back();
+    }
+
+    // 执行上下文结束后销毁其区域栈（此时所有调用均已返回，区域为空）
+    void destroy_region_stack(region_stack* stack) {
+        if (stack == &main_regions) return;
+        for (const auto& r: stack->regions) {
+            for (const auto* s: r.strings) delete s;
+            for (const auto* a: r.arrays) delete a;
+        }
+        std::erase(region_stacks, stack);
+        delete stack;
+    }
+
+    // 切换执行上下文时切换当前使用的区域栈
+    [[nodiscard]] region_stack* current_region_stack() const {
+        return active_regions;
+    }
+
+    void use_region_stack(region_stack* stack) {
+        active_regions = stack;
+    }
+
+    // 进入一层调用时开启新的区域
+    void enter_region() {
+        if (++active_regions->current == active_regions->regions.size()) active_regions->regions.emplace_back();
+    }
+
+    // 函数返回时释放其区域中的全部对象
+    void leave_region() {
+        region& r = active_regions->regions[active_regions->current--];
+        if (r.strings.empty() && r.arrays.empty()) return;
+        uint64_t freed = 0;
+        for (const auto* s: r.strings) {
+            freed += size_of(s);
+            delete s;
+        }
+        for (const auto* a: r.arrays) {
+            freed += size_of(a);
+            delete a;
+        }
+        live_bytes -= std::min(live_bytes, freed);
+        r.strings.clear();
+        r.arrays.clear();
+    }
+
+    // 开启内存分析时记下新对象的分配位置
+    template <class T>
+    void track(T* obj) {
+        if (alloc_profiler) [[unlikely]] obj->site = alloc_profiler->allocated(size_of(obj));
+    }
+
+    // 创建对象并添加到池中；local 为真时分配在当前栈帧的区域中
+    EsmelObject createString(const std::string& val, const bool local = false) {
         auto* s = new esmel_string(val);
+        s->heap = heap_id;
+        (local ? active_regions->regions[active_regions->current].strings : all_strings).push_back(s);
+        grow(static_cast<int64_t>(size_of(s)));
+        track(s);
+        return {s};
+    }
+
+    // 以两段字符串为左右子节点创建绳节点（不复制内容）
+    EsmelObject createRope(esmel_string* left, esmel_string* right, const bool local = false) {
+        auto* s = new esmel_string(left, right);
+        s->heap = heap_id;
+        (local ? active_regions->regions[active_regions->current].strings : all_strings).push_back(s);
+        grow(static_cast<int64_t>(size_of(s)));
+        track(s);
+        return {s};
+    }
+
+    // 创建引用 owner 所持有字节的切片（不复制内容）
+    EsmelObject createSlice(std::shared_ptr<const void> owner, const char* data, const uint64_t length) {
+        auto* s = new esmel_string(std::move(owner), data, length);
+        s->heap = heap_id;
         all_strings.push_back(s);
+        grow(static_cast<int64_t>(size_of(s)));
+        track(s);
         return {s};
     }
 
-    EsmelObject createArray() {
+    // 预留即将创建的 n 个字符串对象的位置（如 Split 一次创建许多字符串）
+    void reserve_strings(const size_t n) {
+        if (all_strings.capacity() - all_strings.size() < n) {
+            all_strings.reserve(std::max(all_strings.size() + n, all_strings.capacity() * 2));
+        }
+    }
+
+    EsmelObject createArray(const bool local = false) {
         auto* obj = new esmel_array();
-        all_arrays.push_back(obj);
+        obj->heap = heap_id;
+        (local ? active_regions->regions[active_regions->current].arrays : all_arrays).push_back(obj);
+        grow(static_cast<int64_t>(size_of(obj)));
+        track(obj);
         return {obj};
     }
 
-    // 递归标记
+    // 创建与原对象共享内容的副本（写时复制），只分配对象头
+    EsmelObject copyString(esmel_string* origin, const bool local = false) {
+        auto* s = new esmel_string(std::string());
+        s->heap = heap_id;
+        origin->share_with(s);
+        (local ? active_regions->regions[active_regions->current].strings : all_strings).push_back(s);
+        grow(sizeof(esmel_string) + sizeof(esmel_string*));
+        track(s);
+        return {s};
+    }
+
+    EsmelObject copyArray(esmel_array* origin, const bool local = false) {
+        auto* obj = new esmel_array();
+        obj->heap = heap_id;
+        origin->share_with(obj);
+        (local ? active_regions->regions[active_regions->current].arrays : all_arrays).push_back(obj);
+        grow(sizeof(esmel_array) + sizeof(esmel_array*));
+        track(obj);
+        return {obj};
+    }
+
+    // 标记对象。嵌套的数组用显式栈遍历，不随嵌套层数消耗本机栈（协程的本机栈只有 256 KiB）
     static void mark(const EsmelObject& obj) {
         switch (obj.type) {
         case Type::STRING:
-            obj.value.string_v->marked = true;
+            mark_string(obj.value.string_v);
             break;
         case Type::ARRAY: {
-            // 数组则递归标记
             if (obj.value.array_v->marked) return;
             obj.value.array_v->marked = true;
-            for (const auto& elem: obj.value.array_v->v) {
-                mark(elem);
+            std::vector<esmel_array*> pending = {obj.value.array_v};
+            while (!pending.empty()) {
+                esmel_array* a = pending.back();
+                pending.pop_back();
+                for (const auto& elem: a->read()) {
+                    if (elem.type == Type::STRING) {
+                        mark_string(elem.value.string_v);
+                    } else if (elem.type == Type::ARRAY && !elem.value.array_v->marked) {
+                        elem.value.array_v->marked = true;
+                        pending.push_back(elem.value.array_v);
+                    }
+                }
             }
             break;
         }
@@ -45,29 +279,147 @@ public:
         }
     }
 
-    // 清除未标记对象
-    void gc() {
+    // 标记字符串（包括绳的所有子节点）
+    static void mark_string(esmel_string* s) {
+        if (s->marked) return;
+        s->marked = true;
+        if (!s->left) return;
+        std::vector<esmel_string*> pending = {s->left, s->right};
+        while (!pending.empty()) {
+            esmel_string* t = pending.back();
+            pending.pop_back();
+            if (t->marked) continue;
+            t->marked = true;
+            if (t->left) {
+                pending.push_back(t->left);
+                pending.push_back(t->right);
+            }
+        }
+    }
+
+    // 并行工作线程的标记：只标记本堆的对象。其它堆的数组中可能存有本堆的对象（工作函数修改了传入的元素），
+    // 因此仍要穿过这些数组，但不修改它们的标记；其它堆的字符串不会引用本堆的对象。
+    void mark_owned(const EsmelObject& obj, std::unordered_set<const esmel_array*>& foreign) const {
+        std::vector<const EsmelObject*> pending = {&obj};
+        while (!pending.empty()) {
+            const EsmelObject& o = *pending.back();
+            pending.pop_back();
+            if (o.type == Type::STRING) {
+                if (o.value.string_v->heap == heap_id) mark_string_owned(o.value.string_v);
+            } else if (o.type == Type::ARRAY) {
+                esmel_array* a = o.value.array_v;
+                if (a->heap == heap_id) {
+                    if (a->marked) continue;
+                    a->marked = true;
+                } else if (!foreign.insert(a).second) {
+                    continue;
+                }
+                for (const auto& elem: a->read()) {
+                    pending.push_back(&elem);
+                }
+            }
+        }
+    }
+
+    void mark_string_owned(esmel_string* s) const {
+        std::vector<esmel_string*> pending = {s};
+        while (!pending.empty()) {
+            esmel_string* t = pending.back();
+            pending.pop_back();
+            if (t->heap != heap_id || t->marked) continue;
+            t->marked = true;
+            if (t->left) {
+                pending.push_back(t->left);
+                pending.push_back(t->right);
+            }
+        }
+    }
+
+    // 展平对象中所有的绳，使其可以被多个线程同时只读访问（读取绳会惰性展平，即修改对象）
+    static void prepare_shared(const EsmelObject& obj, std::unordered_set<const esmel_array*>& seen) {
+        std::vector<const EsmelObject*> pending = {&obj};
+        while (!pending.empty()) {
+            const EsmelObject& o = *pending.back();
+            pending.pop_back();
+            if (o.type == Type::STRING) {
+                if (o.value.string_v->left) o.value.string_v->flatten();
+            } else if (o.type == Type::ARRAY && seen.insert(o.value.array_v).second) {
+                for (const auto& elem: o.value.array_v->read()) {
+                    pending.push_back(&elem);
+                }
+            }
+        }
+    }
+
+    // 接管另一个堆（并行工作线程）的全部对象。此时工作线程的调用均已返回，区域为空。
+    void adopt(EsmelObjectPool& other) {
+        for (auto* s: other.all_strings) {
+            s->heap = heap_id;
+            all_strings.push_back(s);
+        }
+        for (auto* a: other.all_arrays) {
+            a->heap = heap_id;
+            all_arrays.push_back(a);
+        }
+        other.all_strings.clear();
+        other.all_arrays.clear();
+        grow(static_cast<int64_t>(other.live_bytes));
+        other.live_bytes = 0;
+        other.set_gc_growth(other.gc_growth);
+    }
+
+    // 清除未标记的对象，并清除存活对象的标记
+    template <class T>
+    static uint64_t sweep(std::vector<T*>& objects) {
         uint64_t deleted = 0;
-        for (uint64_t i = 0; i < all_strings.size(); i++) {
-            if (all_strings[i]->marked) {
-                all_strings[i]->marked = false;
-                all_strings[i-deleted] = all_strings[i];
+        for (uint64_t i = 0; i < objects.size(); i++) {
+            if (objects[i]->marked) {
+                objects[i]->marked = false;
+                objects[i-deleted] = objects[i];
             } else {
-                delete all_strings[i];
+                delete objects[i];
                 deleted++;
             }
         }
-        all_strings.resize(all_strings.size() - deleted);
-        deleted = 0;
-        for (uint64_t i = 0; i < all_arrays.size(); i++) {
-            if (all_arrays[i]->marked) {
-                all_arrays[i]->marked = false;
-                all_arrays[i-deleted] = all_arrays[i];
-            } else {
-                delete all_arrays[i];
-                deleted++;
+        objects.resize(objects.size() - deleted);
+        return deleted;
+    }
+
+    // 清除后重新统计存活对象的大小，从而校正两次回收之间的估算误差
+    void gc() {
+        uint64_t strings_deleted = sweep(all_strings);
+        uint64_t arrays_deleted = sweep(all_arrays);
+        for (auto* stack: region_stacks) {
+            for (auto& r: stack->regions) {
+                strings_deleted += sweep(r.strings);
+                arrays_deleted += sweep(r.arrays);
+            }
+        }
+
+        // 共享缓冲区的平摊份额取决于清除后剩余的共享者数量，因此在清除完成后统计
+        if (alloc_profiler) alloc_profiler->begin_survey();
+        auto survey = [this](const auto* obj) {
+            const uint64_t size = size_of(obj);
+            if (alloc_profiler) [[unlikely]] alloc_profiler->survived(obj->site, size);
+            return size;
+        };
+        uint64_t live = 0;
+        for (const auto* s: all_strings) live += survey(s);
+        for (const auto* a: all_arrays) live += survey(a);
+        for (const auto* stack: region_stacks) {
+            for (const auto& r: stack->regions) {
+                for (const auto* s: r.strings) live += survey(s);
+                for (const auto* a: r.arrays) live += survey(a);
             }
         }
-        all_arrays.resize(all_arrays.size() - deleted);
+        live_bytes = live;
+        esmel_untracked_bytes = 0;
+        gc_threshold = gc_growth > 0
+            ? std::max(gc_min_threshold, static_cast<uint64_t>(static_cast<double>(live) * gc_growth))
+            : UINT64_MAX;
+        if (heap_limit) gc_threshold = std::min(gc_threshold, heap_limit);
+#ifdef ESMEL_STATS
+        esmel_stats.count_gc(strings_deleted, arrays_deleted);
+#endif
     }
 };
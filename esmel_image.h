@@ -0,0 +1,231 @@
+#pragma once
+
+// 程序映像：保存编译后的函数、字符串字面量、Main 的局部变量以及从它们可达的堆对象，
+// 之后的运行直接加载映像并从保存处继续执行，省去编译与初始化。
+//
+// 格式（小端）：文件头，原生函数名，函数，字符串字面量，字符串对象，数组对象，Main 的局部变量。
+// 对象之间的引用保存为对象编号，加载时重定位为新对象的指针。
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "esmel_binary.h"
+#include "esmel_callable.h"
+#include "esmel_gc.h"
+#include "esmel_native.h"
+#include "esmel_object.h"
+#include "esmel_optimizer.h"
+
+constexpr char esmel_image_magic[8] = {'E', 'S', 'M', 'E', 'L', 'I', 'M', 'G'};
+constexpr uint32_t esmel_image_version = 4;
+
+// 加载后的映像
+struct esmel_image {
+	std::vector<esmel_function> functions;
+	std::vector<std::string> static_str;
+	std::vector<EsmelObject> variables;		// Main 的局部变量
+	uint64_t resume_line = 0;				// 继续执行的行
+};
+
+class esmel_image_writer {
+	esmel_binary_writer out;
+	std::unordered_map<const void*, uint64_t> ids;		// 对象 -> 编号（字符串与数组分别编号）
+	std::vector<esmel_string*> strings;
+	std::vector<esmel_array*> arrays;
+
+	// 为对象分配编号，新发现的数组稍后再写出其元素
+	void discover(const EsmelObject& obj) {
+		if (obj.type == Type::STRING) {
+			if (ids.emplace(obj.value.string_v, strings.size()).second) strings.push_back(obj.value.string_v);
+		} else if (obj.type == Type::ARRAY) {
+			if (ids.emplace(obj.value.array_v, arrays.size()).second) arrays.push_back(obj.value.array_v);
+		}
+	}
+
+	void put_object(const EsmelObject& obj) {
+		out.put<uint8_t>(static_cast<uint8_t>(obj.type));
+		if (obj.type == Type::STRING) out.put<uint64_t>(ids.at(obj.value.string_v));
+		else if (obj.type == Type::ARRAY) out.put<uint64_t>(ids.at(obj.value.array_v));
+		else out.put(obj.value);
+	}
+
+public:
+	bool write(const std::string& path, const std::vector<esmel_function>& functions, const std::vector<std::string>& static_str,
+		const EsmelObject* variables, const uint64_t variable_count, const uint64_t resume_line) {
+		out.put_header(esmel_image_magic, esmel_image_version);
+		out.put<uint64_t>(resume_line);
+
+		// CallNative 按下标引用原生函数，加载时注册的原生函数必须相同
+		out.put<uint64_t>(esmel_natives().size());
+		for (const auto& native: esmel_natives()) out.put_string(native.name);
+
+		out.put<uint64_t>(functions.size());
+		for (const auto& func: functions) out.put_function(func);
+
+		out.put<uint64_t>(static_str.size());
+		for (const auto& s: static_str) out.put_string(s);
+
+		// 从局部变量出发找出所有可达对象（用显式的队列，避免深层嵌套的数组导致递归过深）
+		for (uint64_t i = 0; i < variable_count; i++) discover(variables[i]);
+		for (size_t i = 0; i < arrays.size(); i++) {
+			for (const auto& elem: arrays[i]->read()) discover(elem);
+		}
+
+		// 字符串展平后保存内容
+		out.put<uint64_t>(strings.size());
+		for (auto* s: strings) out.put_string(s->view());
+		out.put<uint64_t>(arrays.size());
+		for (const auto* a: arrays) {
+			out.put<uint64_t>(a->read().size());
+			for (const auto& elem: a->read()) put_object(elem);
+		}
+
+		out.put<uint64_t>(variable_count);
+		for (uint64_t i = 0; i < variable_count; i++) put_object(variables[i]);
+
+		return out.save(path);
+	}
+};
+
+class esmel_image_reader {
+	esmel_binary_reader in;
+
+	// 读取对象，引用按编号重定位为已创建的对象
+	EsmelObject get_object(const std::vector<EsmelObject>& strings, const std::vector<EsmelObject>& arrays) {
+		const auto type = static_cast<Type>(in.get<uint8_t>());
+		EsmelObject obj;
+		if (type == Type::STRING || type == Type::ARRAY) {
+			const auto id = in.get<uint64_t>();
+			const auto& pool = type == Type::STRING ? strings : arrays;
+			if (id >= pool.size()) {
+				in.ok = false;
+				return obj;
+			}
+			return pool[id];
+		}
+		if (type > Type::TYPE) {
+			in.ok = false;
+			return obj;
+		}
+		obj.type = type;
+		obj.value = in.get<decltype(obj.value)>();
+		return obj;
+	}
+
+	// 检查函数代码的操作数都在范围内：槽位、字符串字面量、函数与原生函数编号、类型、跳转目标，
+	// 以及每行运算栈的深度（不弹出不存在的值，不超过栈帧预留的空间）。损坏的映像即使文件结构完整也不能执行
+	static bool valid_code(const esmel_function& func, const esmel_image& image, const std::vector<uint64_t>& arity) {
+		if (func.arguments > func.variable_count || func.variable_count > UINT32_MAX) return false;
+		if (func.memoize && func.arguments > memo_max_arguments) return false;
+		for (const auto& line: func.code) {
+			uint64_t depth = 0;
+			for (size_t k = 0; k < line.size(); k++) {
+				const esmel_op_code& code = line[k];
+				const uint64_t data = code.data;
+				if ((reads_slot(code.op) || writes_slot(code.op)) && slot_of(code) >= func.variable_count) return false;
+				switch (code.op) {
+				case operation::LoadInvariant:
+					if ((data >> 32) >= line.size() - k) return false;
+					break;
+				case operation::GetStaticStr: case operation::GetStaticStrLocal:
+					if (data >= image.static_str.size()) return false;
+					break;
+				case operation::Call: case operation::Spawn:
+					if (data >= image.functions.size()) return false;
+					break;
+				case operation::ParallelMap: case operation::ParallelFor: case operation::SortBy:
+					if (data >= image.functions.size() || image.functions[data].arguments != 1) return false;
+					break;
+				case operation::CallNative:
+					if (data >= esmel_natives().size()) return false;
+					break;
+				case operation::Goto: case operation::GotoUnless:
+					if (data > func.code.size()) return false;
+					break;
+				case operation::CreateType:
+					if (data > static_cast<uint64_t>(Type::TYPE)) return false;
+					break;
+				case operation::LazyCompile:
+					return false;		// 保存映像前所有函数都已编译
+				default:
+					break;
+				}
+				// StoreInvariant 只读取栈顶；其它无法确定栈影响的（LoadInvariant）按压入一个值计算
+				stack_effect effect{};
+				if (code.op == operation::StoreInvariant) effect = {0, 0};
+				else if (!op_stack_effect(code, arity, effect)) effect = {0, 1};
+				if (effect.pops > depth) return false;
+				depth = depth - effect.pops + effect.pushes;
+				if (depth > exec_stack_reserve) return false;
+			}
+		}
+		return true;
+	}
+
+	void parse(EsmelObjectPool& objects, esmel_image& image) {
+		if (!in.expect(esmel_image_magic, esmel_image_version)) return;
+		image.resume_line = in.get<uint64_t>();
+
+		const auto& natives = esmel_natives();
+		if (in.get_count(sizeof(uint64_t)) != natives.size()) {
+			in.ok = false;
+			return;
+		}
+		for (const auto& native: natives) {
+			if (in.get_string() != native.name) {
+				in.ok = false;
+				return;
+			}
+		}
+
+		image.functions.resize(in.get_count(1));
+		for (auto& func: image.functions) {
+			func = in.get_function();
+			if (!in.ok) return;
+		}
+		if (image.functions.empty() || image.resume_line > image.functions[0].code.size()) {
+			in.ok = false;
+			return;
+		}
+
+		image.static_str.resize(in.get_count(sizeof(uint64_t)));
+		for (auto& s: image.static_str) s = in.get_string();
+		if (!in.ok) return;
+		std::vector<uint64_t> arity(image.functions.size());
+		for (size_t i = 0; i < image.functions.size(); i++) arity[i] = image.functions[i].arguments;
+		for (const auto& func: image.functions) {
+			if (!valid_code(func, image, arity)) {
+				in.ok = false;
+				return;
+			}
+		}
+
+		// 先创建所有对象，再填入数组元素（此时引用的对象都已存在）
+		std::vector<EsmelObject> strings(in.get_count(sizeof(uint64_t)));
+		for (auto& s: strings) s = objects.createString(in.get_string());
+		std::vector<EsmelObject> arrays(in.get_count(sizeof(uint64_t)));
+		for (auto& a: arrays) a = objects.createArray();
+		if (!in.ok) return;
+		for (const auto& a: arrays) {
+			auto& elements = a.value.array_v->v;
+			elements.resize(in.get_count(1 + sizeof(uint64_t)));
+			for (auto& elem: elements) elem = get_object(strings, arrays);
+			objects.resized(a.value.array_v, 0);
+			if (!in.ok) return;
+		}
+
+		image.variables.resize(in.get_count(1 + sizeof(uint64_t)));
+		for (auto& v: image.variables) v = get_object(strings, arrays);
+		if (image.variables.size() != image.functions[0].variable_count) in.ok = false;
+	}
+
+public:
+	// 映射映像文件并加载，对象创建在 objects 中。映像无效时返回 false
+	bool read(const std::string& path, EsmelObjectPool& objects, esmel_image& image) {
+		if (!in.map(path)) return false;
+		parse(objects, image);
+		return in.ok;
+	}
+};
@@ -4,9 +4,17 @@
 
 #pragma once
 
+#include <sys/mman.h>
+#include <ucontext.h>
+
 #include <cassert>
 #include <chrono>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <fstream>
 #include <vector>
 #include <string>
 #include <unordered_map>
@@ -14,14 +22,41 @@
 #include <stack>
 #include <memory>
 #include <unordered_set>
+#include <algorithm>
+#include <bit>
 
+#include "esmel_alloc_profiler.h"
 #include "esmel_callable.h"
+#include "esmel_compiler.h"
 #include "esmel_object.h"
 #include "esmel_gc.h"
+#include "esmel_image.h"
+#include "esmel_native.h"
+#include "esmel_parallel.h"
+#include "esmel_serialize.h"
+#include "esmel_sort.h"
+#include "esmel_text.h"
+#include "esmel_profiler.h"
+#include "esmel_stats.h"
 
 using std::vector, std::string, std::unordered_map, std::map, std::stack, std::shared_ptr,
 		std::unordered_set, std::cerr;
 
+// 拼接后总长度不超过此值时直接复制，否则生成绳节点
+constexpr uint64_t rope_min_length = 64;
+// 全局栈大小（对象个数）
+constexpr size_t exec_stack_size = 1 << 16;
+
+// 纯递归函数的返回值缓存：每个函数一张直接映射的表，冲突时覆盖旧项，因此大小固定
+constexpr size_t memo_table_bits = 12;
+
+struct memo_entry {
+	uint64_t hash = 0;
+	bool valid = false;
+	EsmelObject arguments[memo_max_arguments];
+	EsmelObject result;
+};
+
 struct frame // 栈帧
 {
 	uint32_t function_id;	// 函数id
@@ -30,6 +65,31 @@ struct frame // 栈帧
 	EsmelObject* top;		// 栈顶，指向第一个空位
 };
 
+// 协程（Spawn 创建的任务）的栈大小。本机栈按需提交，因此大量挂起的任务只占用实际用到的内存。
+constexpr size_t task_exec_stack_size = 1 << 12;		// 运算栈（对象个数）
+constexpr size_t task_native_stack_size = 256 << 10;	// 本机栈（字节），最低一页为保护页
+constexpr size_t task_native_stack_margin = 32 << 10;	// 本机栈剩余不足此值时报栈溢出
+
+// 任务：可挂起与恢复的执行上下文，拥有独立的运算栈、栈帧与本机栈。
+// 主程序本身也是一个任务（使用进程的运算栈与本机栈）。
+struct esmel_task {
+	enum class state: uint8_t {
+		ready, running, waiting, done
+	};
+	int64_t id = 0;
+	state status = state::running;
+	uint32_t function_id = 0;
+	ucontext_t context{};
+	char* native_stack = nullptr;				// 主任务为空
+	const char* native_stack_limit = nullptr;	// 本机栈溢出检查的下限，主任务为空（不检查）
+	EsmelObject* exec_stack = nullptr;
+	EsmelObject* exec_stack_end = nullptr;
+	std::vector<frame> frames;					// 挂起时保存的栈帧
+	EsmelObjectPool::region_stack* regions = nullptr;
+	EsmelObject result;							// 结束后的返回值
+	std::vector<esmel_task*> waiters;			// 等待本任务结束的任务
+};
+
 class EsmelInterpreter
 {
 public:
@@ -39,10 +99,67 @@ public:
 	std::vector<frame> stack_frame; // 栈帧（顶部表示当前的栈帧，存储局部变量信息。）
 
 	EsmelObject* exec_stack;	// 全局栈 (Esmel 3.8)
+	EsmelObject* exec_stack_end;	// 当前任务运算栈的末尾
+	const char* native_stack_limit = nullptr;	// 当前任务本机栈的下限（主任务不检查）
+	EsmelProfiler* profiler = nullptr;	// 性能分析器（为空表示未开启）
+	std::string stats_file = "esmel_stats.json";	// 执行统计输出文件（仅 ESMEL_STATS 构建）
+	std::string snapshot_file;	// 非空时，执行到 Snapshot 将映像保存到此文件并退出
+	esmel_compiler* lazy_compiler = nullptr;	// 按需编译时编译 LazyCompile 桩对应的函数（与工作解释器共用）
+
+	// 执行预算：每次回跳（Goto 跳到本行或之前的行，即循环的每一轮）与函数调用消耗 1，直线执行的代码与向前的跳转不计数。
+	// 用尽时调用 on_budget_exhausted：返回新的预算则从原处继续（此前宿主可以挂起线程、检查时限等），
+	// 返回 0 或未设置时报错退出。并行工作解释器不调用它，用尽时直接报错。
+	static constexpr uint64_t unlimited_budget = UINT64_MAX;
+	uint64_t budget = unlimited_budget;
+	std::function<uint64_t(EsmelInterpreter&)> on_budget_exhausted;
+
+	// 协程调度：所有任务在同一线程上协作式地轮流运行
+	esmel_task main_task;
+	esmel_task* current_task = &main_task;
+	unordered_map<int64_t, std::unique_ptr<esmel_task>> tasks;	// 尚未被 Await 的任务
+	std::deque<esmel_task*> ready_tasks;		// 可运行的任务
+	std::vector<esmel_task*> finished_tasks;	// 已结束、尚未释放栈的任务
+	int64_t next_task_id = 1;
+	static inline thread_local EsmelInterpreter* running = nullptr;	// 新任务的入口由此找到解释器
+
+	// 并行执行：ParallelMap / ParallelFor 在线程池上运行，每个线程使用一个工作解释器，
+	// 工作解释器有自己的运算栈与堆，结束后由调用者接管其堆中的对象
+	size_t parallel_threads = std::max(1u, std::thread::hardware_concurrency());
+	bool worker = false;						// 是否是并行工作解释器
+	std::mutex* output_lock = nullptr;			// 并行执行期间保护标准输入输出
+	std::mutex output_mutex;
+	std::unique_ptr<EsmelThreadPool> thread_pool;
+	std::vector<std::unique_ptr<EsmelInterpreter>> parallel_workers;
+	EsmelWorkRanges work_ranges;
+	std::vector<EsmelObject> parallel_roots;	// 工作解释器已处理的元素（元素可能被修改为引用本堆的对象）
+	std::vector<std::pair<uint64_t, EsmelObject>> parallel_results;	// 工作解释器计算出的 (下标, 结果)
+	std::vector<std::unique_ptr<memo_entry[]>> memo_tables;		// 函数id -> 返回值缓存（用到时才分配）
+#ifdef ESMEL_STATS
+	EsmelStats parallel_stats;					// 工作解释器本次并行执行的统计，由调用者合并
+#endif
 
 	EsmelInterpreter() {
-		exec_stack = static_cast<EsmelObject *>(malloc(512 * sizeof(EsmelObject)));
+		exec_stack = static_cast<EsmelObject *>(malloc(exec_stack_size * sizeof(EsmelObject)));
+		exec_stack_end = exec_stack + exec_stack_size;
 		stack_frame.emplace_back(-1, 0, exec_stack, exec_stack);
+		main_task.regions = objects.current_region_stack();
+	}
+
+	~EsmelInterpreter() {
+		// Main 返回时仍未结束的任务被丢弃（Main 只会在主任务的上下文中返回）
+		for (auto& [id, task]: tasks) release_task(task.get());
+		free(exec_stack);
+	}
+
+	// 比较运算（a1 为左操作数）
+	template <class T>
+	static bool compare(const operation op, const T a1, const T a2) {
+		switch (op) {
+		case operation::Less: return a1 < a2;
+		case operation::ELess: return a1 <= a2;
+		case operation::Greater: return a1 > a2;
+		default: return a1 >= a2;
+		}
 	}
 
 	__attribute__((always_inline))
@@ -50,28 +167,502 @@ public:
 		*(stack_frame.back().top++) = e;
 	}
 
+	// 标记一个调用栈上的根。栈帧依次相接，每个栈帧占 [base, top)，前 variable_count 个为局部变量，其后为运算中的临时值。
+	// 有栈图的函数只标记所在行仍会被读取的局部变量，其余的置为 Undefined，使其引用的对象可以被回收。
+	template <class Mark>
+	void mark_frames(std::vector<frame>& frames, const Mark& mark) {
+		for (auto& f: frames) {
+			const EsmelObject* end = f.top;
+			if (f.function_id >= functions.size() || f.on_line >= functions[f.function_id].stack_maps.size()) {
+				for (const EsmelObject* i = f.base; i != end; ++i) mark(*i);
+				continue;
+			}
+			const auto& func = functions[f.function_id];
+			const auto& live = func.stack_maps[f.on_line];
+			size_t next = 0;
+			for (uint32_t s = 0; s < func.variable_count; s++) {
+				if (next < live.size() && live[next] == s) {
+					mark(f.base[s]);
+					next++;
+				} else {
+					f.base[s] = EsmelObject();
+				}
+			}
+			for (const EsmelObject* i = f.base + func.variable_count; i < end; ++i) mark(*i);
+		}
+	}
+
 	void gc() {
-		for (const EsmelObject* i = exec_stack; i != stack_frame.back().top; ++i) {
-			EsmelObjectPool::mark(i);
+		// 工作解释器只标记本堆的对象，不修改调用者堆中对象的标记（其它线程可能正在读取）
+		std::unordered_set<const esmel_array*> foreign;
+		auto mark = [&](const EsmelObject& obj) {
+			if (worker) objects.mark_owned(obj, foreign);
+			else EsmelObjectPool::mark(obj);
+		};
+		mark_frames(stack_frame, mark);
+		// 挂起的任务的栈与已结束任务的返回值
+		auto mark_task = [&](esmel_task& task) {
+			if (task.status == esmel_task::state::done) {
+				mark(task.result);
+				return;
+			}
+			mark_frames(task.frames, mark);
+		};
+		if (current_task != &main_task) mark_task(main_task);
+		for (const auto& [id, task]: tasks) {
+			if (task.get() != current_task) mark_task(*task);
 		}
+		for (const auto& obj: parallel_roots) mark(obj);
+		for (const auto& [index, obj]: parallel_results) mark(obj);
 		objects.gc();
+		// 收到 SIGUSR1 后（run 在行边界上发现时会立即回收），在回收刚结束、存活数据最新时写出内存分析报告
+		if (EsmelAllocProfiler::requested && objects.alloc_profiler && !worker) [[unlikely]] {
+			EsmelAllocProfiler::requested = 0;
+			objects.alloc_profiler->report(functions);
+		}
+	}
+
+	// 释放任务的运算栈、本机栈与区域栈
+	void release_task(esmel_task* task) {
+		if (task->native_stack) {
+			munmap(task->native_stack, task_native_stack_size);
+			task->native_stack = nullptr;
+		}
+		if (task->exec_stack) {
+			free(task->exec_stack);
+			task->exec_stack = nullptr;
+		}
+		if (task->regions) {
+			objects.destroy_region_stack(task->regions);
+			task->regions = nullptr;
+		}
+		task->frames = {};
+	}
+
+	// 切换到另一个任务，直到本任务再次被调度时返回
+	void switch_to(esmel_task* next) {
+		esmel_task* prev = current_task;
+		std::swap(prev->frames, stack_frame);
+		prev->exec_stack = exec_stack;
+		prev->exec_stack_end = exec_stack_end;
+		prev->native_stack_limit = native_stack_limit;
+		prev->regions = objects.current_region_stack();
+
+		std::swap(stack_frame, next->frames);
+		exec_stack = next->exec_stack;
+		exec_stack_end = next->exec_stack_end;
+		native_stack_limit = next->native_stack_limit;
+		objects.use_region_stack(next->regions);
+		next->status = esmel_task::state::running;
+		current_task = next;
+		running = this;
+
+		swapcontext(&prev->context, &next->context);
+		reap();
+	}
+
+	// 运行下一个可运行的任务；没有可运行的任务时说明所有任务都在互相等待
+	void schedule() {
+		if (ready_tasks.empty()) {
+			cerr << "Deadlock: every task is waiting for another task.";
+			error();
+		}
+		esmel_task* next = ready_tasks.front();
+		ready_tasks.pop_front();
+		switch_to(next);
+	}
+
+	// 释放已结束任务的栈（不能在任务自己的本机栈上释放，因此推迟到切换之后）
+	void reap() {
+		for (auto* task: finished_tasks) {
+			release_task(task);
+		}
+		finished_tasks.clear();
+	}
+
+	// 新任务的入口：调用任务函数，结束后唤醒等待者并切换到其它任务，不会返回
+	static void task_entry() {
+		EsmelInterpreter* self = running;
+		self->reap();
+		esmel_task* task = self->current_task;
+		self->call(task->function_id);
+		task->result = *(self->stack_frame.back().top - 1);
+		task->status = esmel_task::state::done;
+		for (auto* waiter: task->waiters) {
+			waiter->status = esmel_task::state::ready;
+			self->ready_tasks.push_back(waiter);
+		}
+		task->waiters.clear();
+		self->finished_tasks.push_back(task);
+		self->schedule();
+	}
+
+	// 创建任务，参数从当前栈顶取得
+	int64_t spawn(const uint32_t id) {
+		auto task = std::make_unique<esmel_task>();
+		task->id = next_task_id++;
+		task->function_id = id;
+		task->status = esmel_task::state::ready;
+		task->exec_stack = static_cast<EsmelObject *>(malloc(task_exec_stack_size * sizeof(EsmelObject)));
+		task->exec_stack_end = task->exec_stack + task_exec_stack_size;
+		const uint64_t arguments = functions[id].arguments;
+		stack_frame.back().top -= arguments;
+		std::copy_n(stack_frame.back().top, arguments, task->exec_stack);
+		task->frames.emplace_back(-1, 0, task->exec_stack, task->exec_stack + arguments);
+		task->regions = objects.create_region_stack();
+
+		void* stack = mmap(nullptr, task_native_stack_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (stack == MAP_FAILED) {
+			cerr << "Cannot allocate a stack for a new task.";
+			error();
+		}
+		task->native_stack = static_cast<char*>(stack);
+		mprotect(task->native_stack, 4096, PROT_NONE);
+		task->native_stack_limit = task->native_stack + task_native_stack_margin;
+		getcontext(&task->context);
+		task->context.uc_stack.ss_sp = task->native_stack;
+		task->context.uc_stack.ss_size = task_native_stack_size;
+		task->context.uc_link = nullptr;
+		makecontext(&task->context, task_entry, 0);
+
+		ready_tasks.push_back(task.get());
+		const int64_t handle = task->id;
+		tasks.emplace(handle, std::move(task));
+		return handle;
+	}
+
+	// 丢弃任务（并行工作解释器的函数返回后，其中仍未结束的任务与 Main 返回时一样被丢弃）
+	void drop_tasks() {
+		for (auto& [id, task]: tasks) release_task(task.get());
+		tasks.clear();
+		ready_tasks.clear();
+		reap();
+	}
+
+	// 对 input 的每个元素调用函数 id：ParallelMap 的结果存入 result（已预先分配好长度），ParallelFor 丢弃结果
+	void map_serial(const uint32_t id, esmel_array* input, esmel_array* result) {
+		const size_t n = input->read().size();
+		for (size_t i = 0; i < n && i < input->read().size(); i++) {
+			push(input->read()[i]);
+			call(id);
+			const EsmelObject value = *--stack_frame.back().top;
+			if (result) result->v[i] = value;
+		}
+	}
+
+	// 工作解释器：不断取得下标区间并处理其中的元素，直到所有区间都被取完
+	void run_parallel_job(const uint32_t id, const esmel_array* input, const size_t self, const uint64_t chunk,
+		EsmelWorkRanges& ranges, const bool keep_results) {
+#ifdef ESMEL_STATS
+		// 0 号工作线程就是调用者的线程，先换下线程原有的统计，结束后再换回
+		std::swap(esmel_stats, parallel_stats);
+#endif
+		uint64_t begin, end;
+		while (ranges.next(self, chunk, begin, end)) {
+			for (uint64_t i = begin; i < end; i++) {
+				const EsmelObject element = input->read()[i];
+				push(element);
+				call(id);
+				const EsmelObject value = *--stack_frame.back().top;
+				parallel_roots.push_back(element);
+				if (keep_results) parallel_results.emplace_back(i, value);
+			}
+		}
+		drop_tasks();
+		objects.sync();
+#ifdef ESMEL_STATS
+		std::swap(esmel_stats, parallel_stats);
+#endif
+	}
+
+	// 在线程池上对数组的每个元素调用函数 id，返回 ParallelMap 的结果数组或 ParallelFor 的原数组。
+	// 每个线程（包括调用者自身）在自己的工作解释器中运行，分配在各自的堆中；全部结束后，
+	// 调用者接管工作解释器堆中的所有对象，因此函数的返回值以及它存入元素中的对象都成为调用者堆中的对象。
+	EsmelObject parallel_map(const uint32_t id, const EsmelObject& input, const bool keep_results) {
+		esmel_array* elements = input.value.array_v;
+		const uint64_t n = elements->read().size();
+		if (n > EsmelWorkRanges::max_size) {
+			cerr << "Array is too large for parallel execution: " << n << " elements.";
+			error();
+		}
+		EsmelObject result = keep_results ? objects.createArray() : input;
+		if (keep_results) {
+			result.value.array_v->v.resize(n);
+			objects.resized(result.value.array_v, 0);
+		}
+		// 工作解释器中的嵌套调用、单线程以及元素过少时直接在当前线程上执行
+		if (worker || parallel_threads <= 1 || n < 2) {
+			push(result);	// 执行期间作为回收的根
+			map_serial(id, elements, keep_results ? result.value.array_v : nullptr);
+			--stack_frame.back().top;
+			return result;
+		}
+
+		if (!thread_pool) {
+			thread_pool = std::make_unique<EsmelThreadPool>(parallel_threads);
+			for (size_t k = 0; k < parallel_threads; k++) {
+				auto w = std::make_unique<EsmelInterpreter>();
+				w->functions = functions;
+				w->static_str = static_str;
+				w->worker = true;
+				w->lazy_compiler = lazy_compiler;
+				w->output_lock = &output_mutex;
+				w->objects.heap_id = static_cast<uint16_t>(k + 1);
+				parallel_workers.push_back(std::move(w));
+			}
+		}
+		// 每个工作解释器最多使用调用者剩余的预算，结束后从调用者的预算中扣除它们用掉的部分
+		for (const auto& w: parallel_workers) {
+			w->budget = budget;
+			w->objects.heap_limit = objects.heap_limit;
+			w->objects.set_gc_growth(objects.gc_growth);
+		}
+		// 工作线程只读取调用者堆中的对象，先展平其中的绳（读取绳会修改它）
+		std::unordered_set<const esmel_array*> seen;
+		EsmelObjectPool::prepare_shared(input, seen);
+		push(result);
+
+		const size_t workers = parallel_workers.size();
+		const uint64_t chunk = std::clamp<uint64_t>(n / (workers * 8), 1, 256);
+		work_ranges.reset(n, workers);
+		output_lock = &output_mutex;
+		thread_pool->run([&](const size_t k) {
+			parallel_workers[k]->run_parallel_job(id, elements, k, chunk, work_ranges, keep_results);
+		});
+		output_lock = nullptr;
+
+		uint64_t used = 0;
+		for (const auto& w: parallel_workers) {
+			used += budget - w->budget;
+			objects.adopt(w->objects);
+#ifdef ESMEL_STATS
+			esmel_stats.merge(w->parallel_stats);
+			w->parallel_stats = EsmelStats();
+#endif
+			for (const auto& [index, value]: w->parallel_results) result.value.array_v->v[index] = value;
+			w->parallel_roots.clear();
+			w->parallel_results.clear();
+		}
+		if (used >= budget) {
+			budget = 0;
+			budget_exhausted();
+		} else {
+			budget -= used;
+		}
+		--stack_frame.back().top;
+		return result;
+	}
+
+	// 保存映像并退出，之后以 --image 运行时从下一行继续。只能在 Main 中、没有其它任务时保存
+	void save_snapshot(const uint64_t line) {
+		if (stack_frame.size() != 2 || current_task != &main_task || worker) {
+			cerr << "Snapshot can only be used in Main.";
+			error();
+		}
+		if (!tasks.empty()) {
+			cerr << "Cannot take a snapshot while tasks are running.";
+			error();
+		}
+		// 映像中没有编译器，先编译所有尚未调用过的函数
+		if (lazy_compiler) {
+			for (uint32_t id = 0; id < functions.size(); id++) {
+				if (is_lazy_stub(functions[id])) functions[id] = lazy_compiler->compile_lazily(id, static_str);
+			}
+		}
+		if (!esmel_image_writer().write(snapshot_file, functions, static_str, stack_frame.back().base,
+			functions[0].variable_count, line + 1)) {
+			cerr << "Cannot write the image: " << snapshot_file;
+			error();
+		}
+		std::cout.flush();
+		exit(EXIT_SUCCESS);
+	}
+
+	// 并行执行期间（工作解释器中）标准输入输出需要加锁
+	void write_output(const std::string_view text, const bool line) {
+		std::unique_lock<std::mutex> lock;
+		if (output_lock) lock = std::unique_lock(*output_lock);
+		std::cout << text;
+		if (line) std::cout << std::endl;
+	}
+
+	// 字符串直接输出内容，不复制
+	void print(const EsmelObject& obj, const bool line) {
+		if (obj.type == Type::STRING) write_output(obj.value.string_v->view(), line);
+		else write_output(obj.to_string(), line);
+	}
+
+	// 取字符串 s 中的一段 [start, start + n)：较长的与原字符串共用内容，不复制
+	EsmelObject substring(esmel_string* s, const uint64_t start, const uint64_t n) {
+		static const size_t inline_capacity = std::string().capacity();
+		// 工作解释器不修改调用者堆中的对象（取得持有者会把自有的内容移入共享缓冲区）
+		if (n <= inline_capacity || (!s->slice && s->heap != objects.heap_id)) {
+			return objects.createString(std::string(s->view().substr(start, n)));
+		}
+		auto owner = s->slice_owner();
+		return objects.createSlice(std::move(owner), s->view().data() + start, n);
+	}
+
+	std::string read_input() {
+		std::unique_lock<std::mutex> lock;
+		if (output_lock) lock = std::unique_lock(*output_lock);
+		string s;
+		std::getline(std::cin, s);
+		return s;
+	}
+
+	__attribute__((always_inline))
+	void charge_budget() {
+		if (--budget == 0) [[unlikely]] budget_exhausted();
+	}
+
+	__attribute__((noinline, cold))
+	void budget_exhausted() {
+		if (on_budget_exhausted && !worker) budget = on_budget_exhausted(*this);
+		if (budget == 0) {
+			cerr << "Execution budget exhausted.";
+			error();
+		}
+	}
+
+	// 执行到按需编译的函数的桩：编译后替换本函数的代码，补齐新增的局部变量，从第一行重新开始。
+	// 此后 exec_line 不能再访问原来的代码行
+	uint64_t compile_lazily(const uint32_t id) {
+		functions[id] = lazy_compiler->compile_lazily(id, static_str);
+		const esmel_function& func = functions[id];
+		frame& f = stack_frame.back();
+		if (f.base + func.variable_count + exec_stack_reserve > exec_stack_end) {
+			cerr << "Stack overflow.";
+			error();
+		}
+		f.top = f.base + func.variable_count;
+		std::fill(f.base + func.arguments, f.top, EsmelObject());
+		return 0;
+	}
+
+	// 堆大小超过阈值时自动回收，回收后仍超过上限则报错
+	void collect() {
+		gc();
+		if (objects.heap_limit && objects.live_bytes > objects.heap_limit) {
+			cerr << "Heap limit exceeded: " << objects.live_bytes << " bytes live, limit is " << objects.heap_limit << " bytes.";
+			error();
+		}
 	}
 
 	void call(const uint32_t id)
 	// 调用一个非内置的esmel函数。
 	{
+		if (functions[id].memoize) [[unlikely]] {
+			call_memoized(id);
+			return;
+		}
+		call_function(id);
+	}
+
+	// 只缓存不引用堆对象的值：参数与返回值都是这样的值时，返回值只取决于参数的值
+	static bool memoizable_value(const EsmelObject& obj) {
+		return obj.type != Type::STRING && obj.type != Type::ARRAY;
+	}
+
+	// 调用可缓存的函数：参数都是标量时先查缓存，未命中则调用并记录标量返回值
+	void call_memoized(const uint32_t id) {
+		const uint64_t arguments = functions[id].arguments;
+		const EsmelObject* args = stack_frame.back().top - arguments;
+		uint64_t hash = id;
+		for (uint64_t i = 0; i < arguments; i++) {
+			if (!memoizable_value(args[i])) {
+				call_function(id);
+				return;
+			}
+			hash = (hash ^ static_cast<uint64_t>(args[i].type) << 56 ^ std::bit_cast<uint64_t>(args[i].value)) * 0x9E3779B97F4A7C15ull;
+		}
+		auto same_arguments = [&](const memo_entry& e) {
+			for (uint64_t i = 0; i < arguments; i++) {
+				if (e.arguments[i].type != args[i].type
+					|| std::bit_cast<uint64_t>(e.arguments[i].value) != std::bit_cast<uint64_t>(args[i].value)) return false;
+			}
+			return true;
+		};
+		if (memo_tables.size() <= id) memo_tables.resize(functions.size());
+		if (!memo_tables[id]) memo_tables[id] = std::make_unique<memo_entry[]>(size_t{1} << memo_table_bits);
+		const size_t slot = hash >> (64 - memo_table_bits);
+		{
+			const memo_entry& e = memo_tables[id][slot];
+			if (e.valid && e.hash == hash && same_arguments(e)) {
+				stack_frame.back().top -= arguments;
+				push(e.result);
+				return;
+			}
+		}
+
+		// 参数所在的栈空间会被局部变量覆盖，先保存；递归调用也可能占用同一项，因此返回后再写入
+		EsmelObject saved[memo_max_arguments];
+		std::copy_n(args, arguments, saved);
+		call_function(id);
+		const EsmelObject result = *(stack_frame.back().top - 1);
+		if (!memoizable_value(result)) return;
+		memo_entry& e = memo_tables[id][slot];
+		e.hash = hash;
+		e.valid = true;
+		std::copy_n(saved, arguments, e.arguments);
+		e.result = result;
+	}
+
+	__attribute__((always_inline))
+	void call_function(const uint32_t id) {
+#ifdef ESMEL_STATS
+		esmel_stats.count_call(id);
+#endif
+		charge_budget();
 		// 通过下移栈指针，直接从全局栈获取参数。
 		stack_frame.back().top -= functions[id].arguments;
+		if (stack_frame.back().top + functions[id].variable_count + exec_stack_reserve > exec_stack_end
+			|| (native_stack_limit && static_cast<const char*>(__builtin_frame_address(0)) < native_stack_limit)) {
+			cerr << "Stack overflow.";
+			error();
+		}
 
 		stack_frame.emplace_back(id, 0, stack_frame.back().top, stack_frame.back().top + functions[id].variable_count);
+		objects.enter_region();
+		// 局部变量置为 Undefined，避免 GC 扫描到残留的旧值
+		std::fill(stack_frame.back().base + functions[id].arguments, stack_frame.back().top, EsmelObject());
+
+		run(id);
+	}
+
+	// 从映像保存处继续执行 Main
+	void resume(const esmel_image& image) {
+		stack_frame.emplace_back(0, image.resume_line, exec_stack, exec_stack + functions[0].variable_count);
+		objects.enter_region();
+		std::ranges::copy(image.variables, stack_frame.back().base);
+		run(0);
+	}
 
-		uint32_t& l = stack_frame.back().on_line;
-		while (l < functions[stack_frame.back().function_id].code.size()) {
-			l = exec_line(functions[stack_frame.back().function_id].code[l], l);
+	// 执行当前栈帧（函数 id）直到返回，返回值压入调用者的栈
+	__attribute__((always_inline))
+	void run(const uint32_t id) {
+		// 注意：嵌套调用可能使 stack_frame 扩容，因此不能持有对栈帧的引用
+		while (stack_frame.back().on_line < functions[id].code.size()) {
+			const uint32_t l = stack_frame.back().on_line;
+			// 每行开始时丢弃上一行遗留的临时值（如作为语句调用的函数返回值）
+			stack_frame.back().top = stack_frame.back().base + functions[id].variable_count;
+			// 行边界上所有存活值都在栈上，可以安全地自动回收
+			if (objects.over_threshold()) [[unlikely]] collect();
+			// 收到 SIGUSR1 时立即回收一次，回收结束后写出内存分析报告（不回收或关闭自动回收的程序也能得到报告）
+			if (EsmelAllocProfiler::requested && !worker) [[unlikely]] collect();
+			const uint64_t next = exec_line(functions[id].code[l], l);
+			if (EsmelProfiler::pending) [[unlikely]] {
+				// 在更新行号之前采样，使时间计入刚执行完的行
+				if (profiler) profiler->sample(stack_frame, functions);
+			}
+			stack_frame.back().on_line = next;
 		}
 
 		EsmelObject result = *(stack_frame.back().top - 1);
 
+		// 返回值总是逃出栈帧的对象，区域可以整体释放
+		objects.leave_region();
 		stack_frame.pop_back();
 
 		push(result);
@@ -80,12 +671,23 @@ public:
 	void error()
 	// 打印调用栈并非正常退出。
 	{
-		while (!stack_frame.empty())
+		if (profiler) {
+			profiler->stop();
+			profiler->report(functions);
+		}
+		if (objects.alloc_profiler && !worker) objects.alloc_profiler->report(functions);
+#ifdef ESMEL_STATS
+		std::ofstream stats_out(stats_file);
+		esmel_stats.dump(stats_out, functions);
+#endif
+		// 最底部的哨兵帧不对应任何函数
+		while (stack_frame.size() > 1)
 		{
 			auto st = stack_frame.back();
-			std::cerr << std::endl << "\tat " << functions[stack_frame.back().function_id].name
-			<< '(' << functions[stack_frame.back().function_id].file_name
-			<< ':' << functions[stack_frame.back().function_id].real_line_num[st.on_line] << ")";
+			const auto& func = functions[st.function_id];
+			std::cerr << std::endl << "\tat " << func.name
+			<< '(' << func.file_name
+			<< ':' << func.real_line_num[std::min<size_t>(st.on_line, func.real_line_num.size() - 1)] << ")";
 			stack_frame.pop_back();
 		}
 		exit(EXIT_FAILURE);
@@ -94,9 +696,13 @@ public:
 	uint64_t exec_line(vector<esmel_op_code> &code, uint64_t line)
 	// 执行一段esmel代码
 	{
-		for (auto [op, data]: code)
+		const esmel_op_code* const end = code.data() + code.size();
+		for (const esmel_op_code* pc = code.data(); pc != end; ++pc)
 		{
-			// cout << builtin_functions[0](&current_stack, this, &current_frame, data, line);
+			const auto [op, data] = *pc;
+#ifdef ESMEL_STATS
+			esmel_stats.count_op(op);
+#endif
 			switch (op) {
 			case operation::CreateInt:
 				push(std::bit_cast<int64_t>(data));
@@ -111,7 +717,8 @@ public:
 				push(static_cast<Type>(data));
 				break;
 			case operation::GetStaticStr:
-				push(objects.createString(static_str[data]));
+			case operation::GetStaticStrLocal:
+				push(objects.createString(static_str[data], op == operation::GetStaticStrLocal));
 				break;
 			case operation::CreateUndefined:
 				push(EsmelObject());
@@ -151,7 +758,7 @@ public:
 				const auto a2 = stack_frame.back().top-2;
 				stack_frame.back().top -= 1;
 				if (a1->type != a2->type) {
-					cerr << "Unsupported type for Add: " << a1->type_of() << " and " << a2->type_of();
+					cerr << "Unsupported type for Subtract: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
 				switch (a1->type) {
@@ -159,10 +766,10 @@ public:
 					*a2 = a1->value.int_v - a2->value.int_v;
 					break;
 				case Type::FLOAT:
-					*a2 = a2->value.float_v - a1->value.float_v;
+					*a2 = a1->value.float_v - a2->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Add: " << a1->type_of() << " and " << a2->type_of();
+					cerr << "Unsupported type for Subtract: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
 				}
@@ -173,7 +780,7 @@ public:
 				const auto a2 = stack_frame.back().top-2;
 				stack_frame.back().top -= 1;
 				if (a1->type != a2->type) {
-					cerr << "Unsupported type for Add: " << a1->type_of() << " and " << a2->type_of();
+					cerr << "Unsupported type for Multiply: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
 				switch (a1->type) {
@@ -184,181 +791,210 @@ public:
 					*a2 = a2->value.float_v * a1->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Add: " << a1->type_of() << " and " << a2->type_of();
+					cerr << "Unsupported type for Multiply: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
 				}
 				break;
 			}
-				/*
 			case operation::Div: {
-				auto a1 = current_stack[size-1];
-				auto a2 = current_stack[size-2];
-				current_stack.resize(size-2);
-				if (a1.type != a2.type) {
-					cerr << "Unsupported type for Division: " << a1.type_of() << " and " << a2.type_of();
+				const auto a1 = stack_frame.back().top-1;
+				const auto a2 = stack_frame.back().top-2;
+				stack_frame.back().top -= 1;
+				if (a1->type != a2->type) {
+					cerr << "Unsupported type for Division: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
-				switch (a1.type) {
+				switch (a1->type) {
 				case Type::INT:
-					current_stack.emplace_back(a1.value.int_v / a2.value.int_v);
+					if (a2->value.int_v == 0) {
+						cerr << "Division by zero.";
+						error();
+					}
+					if (a2->value.int_v == -1 && a1->value.int_v == INT64_MIN) {
+						cerr << "Integer overflow in Division.";
+						error();
+					}
+					*a2 = a1->value.int_v / a2->value.int_v;
 					break;
 				case Type::FLOAT:
-					current_stack.emplace_back(a1.value.float_v / a2.value.float_v);
+					*a2 = a1->value.float_v / a2->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Division: " << a1.type_of() << " and " << a2.type_of();
+					cerr << "Unsupported type for Division: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
 				}
 				break;
 			}
 			case operation::Mod: {
-				auto a1 = current_stack[size-1];
-				auto a2 = current_stack[size-2];
-				current_stack.resize(size-2);
-				if (a1.type != a2.type) {
-					cerr << "Unsupported type for Modulo: " << a1.type_of() << " and " << a2.type_of();
+				const auto a1 = stack_frame.back().top-1;
+				const auto a2 = stack_frame.back().top-2;
+				stack_frame.back().top -= 1;
+				if (a1->type != Type::INT || a2->type != Type::INT) {
+					cerr << "Unsupported type for Modulo: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
-				switch (a1.type) {
-				case Type::INT:
-					current_stack.emplace_back(a1.value.int_v % a2.value.int_v);
-					break;
-				default: {
-					cerr << "Unsupported type for Modulo: " << a1.type_of() << " and " << a2.type_of();
+				if (a2->value.int_v == 0) {
+					cerr << "Modulo by zero.";
 					error();
 				}
+				if (a2->value.int_v == -1 && a1->value.int_v == INT64_MIN) {
+					cerr << "Integer overflow in Modulo.";
+					error();
 				}
+				*a2 = a1->value.int_v % a2->value.int_v;
 				break;
 			}
-			*/
-			case operation::Print:
-				std::cout << (--stack_frame.back().top)->to_string();
-				break;
-
-			case operation::Goto:
-				return data;
-
-			case operation::Call:
-				call(data);
-				break;
-
-				/*
 			case operation::AddBy: {
-				auto& origin = current_frame.local_variables[data];
-				auto a = current_stack[size-1];
-				current_stack.resize(size-1);
-				if (origin.type != a.type) {
-					cerr << "Unsupported type for Add: " << origin.type_of() << " and " << a.type_of();
+				auto& origin = stack_frame.back().base[data];
+				const auto a = --stack_frame.back().top;
+				if (origin.type != a->type) {
+					cerr << "Unsupported type for Add: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
-				switch (a.type) {
+				switch (a->type) {
 				case Type::INT:
-					origin.value.int_v += a.value.int_v;
+					origin.value.int_v += a->value.int_v;
 					break;
 				case Type::FLOAT:
-					origin.value.float_v += a.value.float_v;;
+					origin.value.float_v += a->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Add: " << a.type_of() << " and " << a.type_of();
+					cerr << "Unsupported type for Add: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
 				}
 				break;
 			}
 			case operation::SubBy: {
-				auto& origin = current_frame.local_variables[data];
-				auto a = current_stack[size-1];
-				current_stack.resize(size-1);
-				if (origin.type != a.type) {
-					cerr << "Unsupported type for Subtract: " << origin.type_of() << " and " << a.type_of();
+				auto& origin = stack_frame.back().base[data];
+				const auto a = --stack_frame.back().top;
+				if (origin.type != a->type) {
+					cerr << "Unsupported type for Subtract: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
-				switch (a.type) {
+				switch (a->type) {
 				case Type::INT:
-					origin.value.int_v -= a.value.int_v;
+					origin.value.int_v -= a->value.int_v;
 					break;
 				case Type::FLOAT:
-					origin.value.float_v -= a.value.float_v;;
+					origin.value.float_v -= a->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Subtract: " << a.type_of() << " and " << a.type_of();
+					cerr << "Unsupported type for Subtract: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
 				}
 				break;
 			}
 			case operation::MulBy: {
-				auto& origin = current_frame.local_variables[data];
-				auto a = current_stack[size-1];
-				current_stack.resize(size-1);
-				if (origin.type != a.type) {
-					cerr << "Unsupported type for Multiply: " << origin.type_of() << " and " << a.type_of();
+				auto& origin = stack_frame.back().base[data];
+				const auto a = --stack_frame.back().top;
+				if (origin.type != a->type) {
+					cerr << "Unsupported type for Multiply: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
-				switch (a.type) {
+				switch (a->type) {
 				case Type::INT:
-					origin.value.int_v *= a.value.int_v;
+					origin.value.int_v *= a->value.int_v;
 					break;
 				case Type::FLOAT:
-					origin.value.float_v *= a.value.float_v;;
+					origin.value.float_v *= a->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Multiply: " << a.type_of() << " and " << a.type_of();
+					cerr << "Unsupported type for Multiply: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
 				}
 				break;
 			}
 			case operation::DivBy: {
-				auto& origin = current_frame.local_variables[data];
-				auto a = current_stack[size-1];
-				current_stack.resize(size-1);
-				if (origin.type != a.type) {
-					cerr << "Unsupported type for Division: " << origin.type_of() << " and " << a.type_of();
+				auto& origin = stack_frame.back().base[data];
+				const auto a = --stack_frame.back().top;
+				if (origin.type != a->type) {
+					cerr << "Unsupported type for Division: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
-				switch (a.type) {
+				switch (a->type) {
 				case Type::INT:
-					origin.value.int_v /= a.value.int_v;
+					if (a->value.int_v == 0) {
+						cerr << "Division by zero.";
+						error();
+					}
+					if (a->value.int_v == -1 && origin.value.int_v == INT64_MIN) {
+						cerr << "Integer overflow in Division.";
+						error();
+					}
+					origin.value.int_v /= a->value.int_v;
 					break;
 				case Type::FLOAT:
-					origin.value.float_v /= a.value.float_v;;
+					origin.value.float_v /= a->value.float_v;
 					break;
 				default: {
-					cerr << "Unsupported type for Division: " << a.type_of() << " and " << a.type_of();
+					cerr << "Unsupported type for Division: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
 				}
 				break;
 			}
 			case operation::ModBy: {
-				auto& origin = current_frame.local_variables[data];
-				auto a = current_stack[size-1];
-				current_stack.resize(size-1);
-				if (origin.type != a.type) {
-					cerr << "Unsupported type for Modulo: " << origin.type_of() << " and " << a.type_of();
+				auto& origin = stack_frame.back().base[data];
+				const auto a = --stack_frame.back().top;
+				if (origin.type != Type::INT || a->type != Type::INT) {
+					cerr << "Unsupported type for Modulo: " << origin.type_of() << " and " << a->type_of();
 					error();
 				}
-				switch (a.type) {
-				case Type::INT:
-					origin.value.int_v %= a.value.int_v;
-					break;
-				default: {
-					cerr << "Unsupported type for Modulo: " << a.type_of() << " and " << a.type_of();
+				if (a->value.int_v == 0) {
+					cerr << "Modulo by zero.";
 					error();
 				}
+				if (a->value.int_v == -1 && origin.value.int_v == INT64_MIN) {
+					cerr << "Integer overflow in Modulo.";
+					error();
 				}
+				origin.value.int_v %= a->value.int_v;
 				break;
 			}
 			case operation::Copy:
+			case operation::CopyLocal: {
+				// 写时复制：副本与原对象共享内容，数组在任一方被修改时才真正复制（字符串不可变，始终共享）
+				const auto a = stack_frame.back().top - 1;
+				const bool local = op == operation::CopyLocal;
+				// 工作解释器复制调用者堆中的对象时直接复制内容，共享会修改原对象
+				if (a->type == Type::STRING) {
+					if (a->value.string_v->heap != objects.heap_id) *a = objects.createString(std::string(a->value.string_v->view()), local);
+					else *a = objects.copyString(a->value.string_v, local);
+				} else if (a->type == Type::ARRAY) {
+					if (a->value.array_v->heap != objects.heap_id) {
+						auto copy = objects.createArray(local);
+						copy.value.array_v->v = a->value.array_v->read();
+						objects.resized(copy.value.array_v, 0);
+						*a = copy;
+					} else {
+						*a = objects.copyArray(a->value.array_v, local);
+					}
+				}
 				break;
+			}
 			case operation::Typeof: {
-				current_stack[size-1] = EsmelObject(current_stack[size-1].type);
+				const auto a = stack_frame.back().top - 1;
+				*a = EsmelObject(a->type);
 				break;
 			}
-			*/
+			case operation::Print:
+				print(*--stack_frame.back().top, false);
+				break;
+
+			case operation::Goto:
+				// 回跳（循环的每一轮）消耗预算；GotoUnless 与 If 只会向前跳转
+				if (data <= line) charge_budget();
+				return data;
+
+			case operation::Call:
+				call(data);
+				break;
+
 			case operation::Equal: {
 				EsmelObject* a1 = stack_frame.back().top - 2;
 				const EsmelObject* a2 = stack_frame.back().top - 1;
@@ -370,12 +1006,12 @@ public:
 				gc();
 				break;
 			case operation::Println:
-				std::cout << (--stack_frame.back().top)->to_string() << std::endl;
+				print(*--stack_frame.back().top, true);
 				break;
 			case operation::If: {
 				const auto condition = --stack_frame.back().top;
 				if (condition->type != Type::BOOLEAN) {
-					cerr << "\'if\' must take a boolean value, but get: " << condition->value.int_v;
+					cerr << "\'if\' must take a boolean value, but get: " << condition->type_of();
 					error();
 				}
 				if (!condition->value.boolean_v) return line+1;
@@ -385,203 +1021,488 @@ public:
 			case operation::Return: {
 				return functions[stack_frame.back().function_id].code.size()+1;
 			}
-				/*
 			case operation::And: {
-				EsmelObject a2 = current_stack[size-2];
-				EsmelObject a1 = current_stack[size-1];
-				current_stack.resize(size-2);
-				if (a1.type == a2.type && a1.type == Type::BOOLEAN) {
-					current_stack[size-2] = a1.value.boolean_v && a2.value.boolean_v;
-				} else {
-					cerr << "Logic And must take two boolean types, but get: " << a1.type_of() << " and " << a2.type_of();
+				const auto a1 = stack_frame.back().top - 1;
+				const auto a2 = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (a1->type != Type::BOOLEAN || a2->type != Type::BOOLEAN) {
+					cerr << "Logic And must take two boolean types, but get: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
-				current_stack.resize(size-1);
+				*a2 = a1->value.boolean_v && a2->value.boolean_v;
 				break;
 			}
 			case operation::Or: {
-				EsmelObject a2 = current_stack[size-2];
-				EsmelObject a1 = current_stack[size-1];
-				current_stack.resize(size-2);
-				if (a1.type == a2.type && a1.type == Type::BOOLEAN) {
-					current_stack[size-2] = a1.value.boolean_v || a2.value.boolean_v;
-				} else {
-					cerr << "Logic Or must take two boolean types, but get: " << a1.type_of() << " and " << a2.type_of();
+				const auto a1 = stack_frame.back().top - 1;
+				const auto a2 = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (a1->type != Type::BOOLEAN || a2->type != Type::BOOLEAN) {
+					cerr << "Logic Or must take two boolean types, but get: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
-				current_stack.resize(size-1);
+				*a2 = a1->value.boolean_v || a2->value.boolean_v;
 				break;
 			}
 			case operation::Not: {
-				EsmelObject a = current_stack[size-1];
-				if (a.type == Type::BOOLEAN) {
-					current_stack[size-1] = !a.value.boolean_v;
-				} else {
-					cerr << "Logic Not must take a boolean type, but get: " << a.type_of();
+				const auto a = stack_frame.back().top - 1;
+				if (a->type != Type::BOOLEAN) {
+					cerr << "Logic Not must take a boolean type, but get: " << a->type_of();
 					error();
 				}
+				*a = !a->value.boolean_v;
 				break;
 			}
 			case operation::Error: {
-				EsmelObject a = current_stack[size-1];
-				cerr << a.to_string();
+				cerr << (--stack_frame.back().top)->to_string();
 				error();
 				break;
 			}
-			*/
 			case operation::GetTime: {
 				push(
 				std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
 				);
 				break;
 			}
-				/*
-			case operation::Readln: {
-				auto o = objects.createString("");
-				std::getline(std::cin, o.value.string_v->v);
-				current_stack.push_back(o);
+			case operation::Readln:
+				push(objects.createString(read_input()));
 				break;
-			}
-			case operation::Less: {
-				EsmelObject a2 = current_stack[size-2];
-				EsmelObject a1 = current_stack[size-1];
-				switch (a1.type) {
-				case Type::INT: if (a2.type == Type::INT) current_stack[size-2] = a1.value.int_v < a2.value.int_v; break;
-				case Type::FLOAT: if(a2.type == Type::FLOAT) current_stack[size-2] = a1.value.float_v < a2.value.float_v; break;
-				default: cerr << "Unsupported type for Modulo: " << a1.type_of() << " and " << a2.type_of(); error();
-				}
-				current_stack.resize(size-1);
-				break;
-			}
-			case operation::ELess: {
-				EsmelObject a2 = current_stack[size-2];
-				EsmelObject a1 = current_stack[size-1];
-				switch (a1.type) {
-				case Type::INT: if (a2.type == Type::INT) current_stack[size-2] = a1.value.int_v <= a2.value.int_v; break;
-				case Type::FLOAT: if(a2.type == Type::FLOAT) current_stack[size-2] = a1.value.float_v <= a2.value.float_v; break;
-				default: cerr << "Unsupported type for Modulo: " << a1.type_of() << " and " << a2.type_of(); error();
-				}
-				current_stack.resize(size-1);
+			case operation::Input:
+				stack_frame.back().base[data] = objects.createString(read_input());
 				break;
-			}
-			case operation::Greater: {
-				EsmelObject a2 = current_stack[size-2];
-				EsmelObject a1 = current_stack[size-1];
-				switch (a1.type) {
-				case Type::INT: if (a2.type == Type::INT) current_stack[size-2] = a1.value.int_v > a2.value.int_v; break;
-				case Type::FLOAT: if(a2.type == Type::FLOAT) current_stack[size-2] = a1.value.float_v > a2.value.float_v; break;
-				default: cerr << "Unsupported type for Modulo: " << a1.type_of() << " and " << a2.type_of(); error();
+			case operation::Less:
+			case operation::ELess:
+			case operation::Greater:
+			case operation::EGreater: {
+				const auto a1 = stack_frame.back().top - 1;
+				const auto a2 = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (a1->type != a2->type || (a1->type != Type::INT && a1->type != Type::FLOAT)) {
+					cerr << "Unsupported type for comparison: " << a1->type_of() << " and " << a2->type_of();
+					error();
 				}
-				current_stack.resize(size-1);
+				*a2 = a1->type == Type::INT
+					? compare(op, a1->value.int_v, a2->value.int_v)
+					: compare(op, a1->value.float_v, a2->value.float_v);
 				break;
 			}
-			case operation::EGreater:
-				break;
-			case operation::Input: {
-				auto o = current_frame.local_variables[data] = objects.createString("");
-				std::getline(std::cin, o.value.string_v->v);
-				break;
-			}
-			case operation::NewArray: {
-				current_stack.push_back(objects.createArray());
+			case operation::NewArray:
+			case operation::NewArrayLocal: {
+				push(objects.createArray(op == operation::NewArrayLocal));
 				break;
 			}
 			case operation::SetAt: {
-				EsmelObject origin = current_stack[size-1];
-				EsmelObject index = current_stack[size-2];
-				EsmelObject target = current_stack[size-3];
-				current_stack.resize(size-3);
-				if (origin.type != Type::ARRAY) {
-					cerr << "SetAt can only be used on arrays, but get: " << origin.type_of();
+				const auto origin = stack_frame.back().top - 1;
+				const auto index = stack_frame.back().top - 2;
+				const auto target = stack_frame.back().top - 3;
+				stack_frame.back().top -= 3;
+				if (origin->type != Type::ARRAY) {
+					cerr << "Put can only be used on arrays, but get: " << origin->type_of();
 					error();
 				}
-				if (index.type != Type::INT) {
-					cerr << "SetAt index must be an Integer, but getL " << index.type_of();
+				if (index->type != Type::INT) {
+					cerr << "Put index must be an Integer, but get: " << index->type_of();
 					error();
 				}
-				if (index.value.int_v >= origin.value.array_v->v.size() || index.value.int_v < 0) {
-					cerr << "Index " << index.value.int_v << " out of range.";
+				if (static_cast<uint64_t>(index->value.int_v) >= origin->value.array_v->read().size()) {
+					cerr << "Index " << index->value.int_v << " out of range.";
 					error();
 				}
-				origin.value.array_v->v[index.value.int_v] = target;
+				objects.writable(origin->value.array_v)[index->value.int_v] = *target;
 				break;
 			}
 			case operation::GetAt: {
-				EsmelObject origin = current_stack[size-1];
-				EsmelObject index = current_stack[size-2];
-				current_stack.resize(size-1);
-				if (origin.type != Type::ARRAY) {
-					cerr << "SetAt can only be used on arrays, but get: " << origin.type_of();
+				const auto origin = stack_frame.back().top - 1;
+				const auto index = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (origin->type != Type::ARRAY) {
+					cerr << "Get can only be used on arrays, but get: " << origin->type_of();
 					error();
 				}
-				if (index.type != Type::INT) {
-					cerr << "SetAt index must be an Integer, but getL " << index.type_of();
+				if (index->type != Type::INT) {
+					cerr << "Get index must be an Integer, but get: " << index->type_of();
 					error();
 				}
-				if (index.value.int_v >= origin.value.array_v->v.size() || index.value.int_v < 0) {
-					cerr << "Index " << index.value.int_v << " out of range.";
+				const auto& elements = origin->value.array_v->read();
+				if (static_cast<uint64_t>(index->value.int_v) >= elements.size()) {
+					cerr << "Index " << index->value.int_v << " out of range.";
 					error();
 				}
-				current_stack[size-2] = origin.value.array_v->v[index.value.int_v];
+				*index = elements[index->value.int_v];
 				break;
 			}
 			case operation::Append: {
-				EsmelObject origin = current_stack[size-1];
-				EsmelObject target = current_stack[size-2];
-				current_stack.resize(size-2);
-				if (origin.type != Type::ARRAY) {
-					cerr << "SetAt can only be used on arrays, but get: " << origin.type_of();
+				const auto origin = stack_frame.back().top - 1;
+				const auto target = stack_frame.back().top - 2;
+				stack_frame.back().top -= 2;
+				if (origin->type != Type::ARRAY) {
+					cerr << "Append can only be used on arrays, but get: " << origin->type_of();
 					error();
 				}
-				origin.value.array_v->v.push_back(target);
+				auto& elements = objects.writable(origin->value.array_v);
+				const auto capacity = elements.capacity();
+				elements.push_back(*target);
+				objects.resized(origin->value.array_v, capacity);
 				break;
 			}
-			case operation::GetLength:
-				if (current_stack[size-1].type == Type::ARRAY) {
-					current_stack[size-1] = EsmelObject{static_cast<long long>(current_stack[size - 1].value.array_v->v.size())};
-				} else if (current_stack[size-1].type == Type::STRING) {
-					current_stack[size-1] = EsmelObject{static_cast<long long>(current_stack[size - 1].value.string_v->v.size())};
+			case operation::GetLength: {
+				const auto a = stack_frame.back().top - 1;
+				if (a->type == Type::ARRAY) {
+					*a = static_cast<int64_t>(a->value.array_v->read().size());
+				} else if (a->type == Type::STRING) {
+					*a = static_cast<int64_t>(a->value.string_v->length);
 				} else {
-					cerr << "Unsupported types for Len: " << current_stack[size-1].type_of();
+					cerr << "Unsupported types for Len: " << a->type_of();
 					error();
 				}
 				break;
-			case operation::Link: {
-				EsmelObject a1 = current_stack[size-1];
-				EsmelObject a2 = current_stack[size-2];
-				current_stack.resize(size-2);
-				if (a1.type != a2.type) {
-					cerr << "Unsupported types for Link: " << a1.type_of() << " and " << a2.type_of();
+			}
+			case operation::Link:
+			case operation::LinkLocal: {
+				const bool local = op == operation::LinkLocal;
+				const auto a1 = stack_frame.back().top - 1;
+				const auto a2 = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (a1->type != a2->type) {
+					cerr << "Unsupported types for Link: " << a1->type_of() << " and " << a2->type_of();
 					error();
 				}
-				switch (a1.type) {
+				switch (a1->type) {
 				case Type::STRING: {
-					current_stack.push_back(objects.createString(a1.value.string_v->v + a2.value.string_v->v));
+					esmel_string* s1 = a1->value.string_v;
+					esmel_string* s2 = a2->value.string_v;
+					// 短串直接拼接，长串只建绳节点，使循环中反复 Link 均摊 O(1)
+					if (s1->length + s2->length <= rope_min_length) {
+						*a2 = objects.createString(std::string(s1->view()).append(s2->view()), local);
+					} else {
+						*a2 = objects.createRope(s1, s2, local);
+					}
 					break;
 				}
 				case Type::ARRAY: {
-					auto a = objects.createArray();
-					a.value.array_v->v.reserve(a1.value.array_v->v.size() + a2.value.array_v->v.size());
-					std::ranges::copy(a1.value.array_v->v, std::back_inserter(a.value.array_v->v));
-					std::ranges::copy(a2.value.array_v->v, std::back_inserter(a.value.array_v->v));
-					current_stack.push_back(a);
+					auto a = objects.createArray(local);
+					a.value.array_v->v.reserve(a1->value.array_v->read().size() + a2->value.array_v->read().size());
+					std::ranges::copy(a1->value.array_v->read(), std::back_inserter(a.value.array_v->v));
+					std::ranges::copy(a2->value.array_v->read(), std::back_inserter(a.value.array_v->v));
+					objects.resized(a.value.array_v, 0);
+					*a2 = a;
 					break;
 				}
 				default: {
-					cerr << "Unsupported types for Link: " << a1.type_of() << " and " << a2.type_of();
+					cerr << "Unsupported types for Link: " << a1->type_of() << " and " << a2->type_of();
+					error();
+				}
+				}
+				break;
+			}
+
+			case operation::GetHeapSize:
+				objects.sync();
+				push(static_cast<int64_t>(objects.live_bytes));
+				break;
+			case operation::GetPeakHeapSize:
+				objects.sync();
+				push(static_cast<int64_t>(objects.peak_bytes));
+				break;
+
+			case operation::GotoUnless: {
+				const auto condition = --stack_frame.back().top;
+				if (condition->type != Type::BOOLEAN) {
+					cerr << "\'While\' must take a boolean value, but get: " << condition->type_of();
+					error();
+				}
+				if (!condition->value.boolean_v) return data;
+				break;
+			}
+			case operation::LoadInvariant: {
+				// 低32位为缓存槽位，高32位为需要跳过的表达式长度
+				const EsmelObject& cached = stack_frame.back().base[data & UINT32_MAX];
+				if (cached.type != Type::UNDEFINED) {
+					push(cached);
+					pc += data >> 32;
+				}
+				break;
+			}
+			case operation::StoreInvariant:
+				stack_frame.back().base[data] = *(stack_frame.back().top - 1);
+				break;
+			case operation::Spawn:
+				push(spawn(data));
+				break;
+			case operation::Yield:
+				// 让出执行权，排到可运行队列末尾
+				if (!ready_tasks.empty()) {
+					current_task->status = esmel_task::state::ready;
+					ready_tasks.push_back(current_task);
+					schedule();
+				}
+				break;
+			case operation::Await: {
+				// 等待任务结束并取得其返回值，每个任务只能被 Await 一次
+				const auto handle = stack_frame.back().top - 1;
+				if (handle->type != Type::INT) {
+					cerr << "Await must take a task, but get: " << handle->type_of();
+					error();
+				}
+				const int64_t task_id = handle->value.int_v;
+				const auto found = tasks.find(task_id);
+				if (found == tasks.end()) {
+					cerr << "Unknown task " << task_id << " (it may have been awaited already).";
+					error();
+				}
+				esmel_task* task = found->second.get();
+				if (task->status != esmel_task::state::done) {
+					// 先恢复的等待者会取走结果并删除任务，因此不允许第二个等待者
+					if (!task->waiters.empty()) {
+						cerr << "Task " << task_id << " is already being awaited by another task.";
+						error();
+					}
+					task->waiters.push_back(current_task);
+					current_task->status = esmel_task::state::waiting;
+					schedule();
+				}
+				*handle = task->result;
+				tasks.erase(task_id);
+				break;
+			}
+			case operation::ParallelMap:
+			case operation::ParallelFor: {
+				const auto input = stack_frame.back().top - 1;
+				if (input->type != Type::ARRAY) {
+					cerr << (op == operation::ParallelMap ? "ParallelMap" : "ParallelFor") << " can only be used on arrays, but get: " << input->type_of();
+					error();
+				}
+				*input = parallel_map(data, *input, op == operation::ParallelMap);
+				break;
+			}
+			case operation::Find:
+			case operation::Contains: {
+				const auto s = stack_frame.back().top - 1;
+				const auto needle = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (s->type != Type::STRING || needle->type != Type::STRING) {
+					cerr << "Unsupported types for " << (op == operation::Find ? "Find" : "Contains") << ": " << s->type_of() << " and " << needle->type_of();
+					error();
+				}
+				const size_t pos = esmel_find(s->value.string_v->view(), needle->value.string_v->view());
+				if (op == operation::Find) *needle = pos == esmel_npos ? static_cast<int64_t>(-1) : static_cast<int64_t>(pos);
+				else *needle = pos != esmel_npos;
+				break;
+			}
+			case operation::Replace: {
+				const auto s = stack_frame.back().top - 1;
+				const auto from = stack_frame.back().top - 2;
+				const auto to = stack_frame.back().top - 3;
+				stack_frame.back().top -= 2;
+				if (s->type != Type::STRING || from->type != Type::STRING || to->type != Type::STRING) {
+					cerr << "Unsupported types for Replace: " << s->type_of() << ", " << from->type_of() << " and " << to->type_of();
+					error();
+				}
+				const std::string_view content = s->value.string_v->view();
+				const std::string_view pattern = from->value.string_v->view();
+				const std::string_view replacement = to->value.string_v->view();
+				if (pattern.empty()) {
+					cerr << "Replace needs a non-empty string to replace.";
+					error();
+				}
+				std::string result;
+				size_t begin = 0;
+				for (size_t pos = esmel_find(content, pattern); pos != esmel_npos; pos = esmel_find(content, pattern, begin)) {
+					result.append(content, begin, pos - begin).append(replacement);
+					begin = pos + pattern.size();
+				}
+				if (begin == 0) {
+					*to = *s;	// 字符串不可变，没有可替换的内容时直接返回原字符串
+				} else {
+					result.append(content, begin);
+					*to = objects.createString(std::move(result));
+				}
+				break;
+			}
+			case operation::Trim: {
+				const auto s = stack_frame.back().top - 1;
+				if (s->type != Type::STRING) {
+					cerr << "Trim can only be used on strings, but get: " << s->type_of();
+					error();
+				}
+				const std::string_view content = s->value.string_v->view();
+				size_t begin = 0, end = content.size();
+				while (begin < end && esmel_is_space(content[begin])) begin++;
+				while (end > begin && esmel_is_space(content[end - 1])) end--;
+				if (begin != 0 || end != content.size()) *s = substring(s->value.string_v, begin, end - begin);
+				break;
+			}
+			case operation::Sort: {
+				const auto a = stack_frame.back().top - 1;
+				if (a->type != Type::ARRAY) {
+					cerr << "Sort can only be used on arrays, but get: " << a->type_of();
+					error();
+				}
+				esmel_sort(objects.writable(a->value.array_v));
+				break;
+			}
+			case operation::SortBy: {
+				// 先对每个元素调用函数求出排序键，再按键重排数组
+				const auto a = stack_frame.back().top - 1;
+				if (a->type != Type::ARRAY) {
+					cerr << "SortBy can only be used on arrays, but get: " << a->type_of();
 					error();
 				}
+				esmel_array* elements = a->value.array_v;
+				const size_t n = elements->read().size();
+				const EsmelObject keys = objects.createArray();
+				keys.value.array_v->v.resize(n);
+				objects.resized(keys.value.array_v, 0);
+				push(keys);		// 执行期间作为回收的根
+				map_serial(data, elements, keys.value.array_v);
+				--stack_frame.back().top;
+				if (elements->read().size() != n) {
+					cerr << "SortBy: the array was changed while computing the keys.";
+					error();
+				}
+				esmel_sort_by(objects.writable(elements), keys.value.array_v->read());
+				break;
+			}
+			case operation::CallNative: {
+				// 参数留在运算栈上直接交给原生函数，返回值写回参数所在的位置
+				const esmel_native& native = esmel_natives()[data];
+				EsmelObject* args = stack_frame.back().top - native.arguments;
+				esmel_native_context context{objects, {}};
+				const EsmelObject result = native.function(context, esmel_native_args({args, native.arguments}));
+				if (!context.error.empty()) [[unlikely]] {
+					cerr << native.name << ": " << context.error;
+					error();
 				}
+				*args = result;
+				stack_frame.back().top = args + 1;
+				break;
+			}
+			case operation::Snapshot:
+				if (!snapshot_file.empty()) save_snapshot(line);
+				break;
+			case operation::LazyCompile:
+				return compile_lazily(static_cast<uint32_t>(data));
+			case operation::Serialize: {
+				const auto file = stack_frame.back().top - 1;
+				const auto value = stack_frame.back().top - 2;
+				stack_frame.back().top -= 2;
+				if (file->type != Type::STRING) {
+					cerr << "Serialize needs a file name, but get: " << file->type_of();
+					error();
+				}
+				esmel_serializer serializer;
+				if (!serializer.write(std::string(file->value.string_v->view()), *value)) {
+					cerr << "Serialize: " << serializer.error;
+					error();
+				}
+				break;
+			}
+			case operation::Deserialize: {
+				const auto file = stack_frame.back().top - 1;
+				if (file->type != Type::STRING) {
+					cerr << "Deserialize needs a file name, but get: " << file->type_of();
+					error();
+				}
+				const std::string path(file->value.string_v->view());
+				if (!esmel_deserializer(objects).read(path, *file)) {
+					cerr << "Deserialize: Cannot read file: " << path << " (missing or damaged)";
+					error();
+				}
+				break;
+			}
+			case operation::ReadFile: {
+				// 只读映射整个文件，得到的字符串是映射的切片；映射在最后一个引用它的字符串被回收时解除
+				const auto file = stack_frame.back().top - 1;
+				if (file->type != Type::STRING) {
+					cerr << "ReadFile needs a file name, but get: " << file->type_of();
+					error();
+				}
+				const std::string path(file->value.string_v->view());
+				auto mapping = std::make_shared<esmel_mapped_file>();
+				if (!mapping->map(path)) {
+					cerr << "ReadFile: Cannot open file: " << path;
+					error();
+				}
+				const char* data = mapping->data;
+				const size_t size = mapping->size;
+				*file = objects.createSlice(std::move(mapping), data, size);
+				break;
+			}
+			case operation::Substring: {
+				const auto s = stack_frame.back().top - 1;
+				const auto start = stack_frame.back().top - 2;
+				const auto length = stack_frame.back().top - 3;
+				stack_frame.back().top -= 2;
+				if (s->type != Type::STRING || start->type != Type::INT || length->type != Type::INT) {
+					cerr << "Unsupported types for Substring: " << s->type_of() << ", " << start->type_of() << " and " << length->type_of();
+					error();
+				}
+				const uint64_t size = s->value.string_v->length;
+				const auto begin = static_cast<uint64_t>(start->value.int_v);
+				const auto n = static_cast<uint64_t>(length->value.int_v);
+				if (begin > size || n > size - begin) {
+					cerr << "Substring " << start->value.int_v << ", " << length->value.int_v << " out of range (length " << size << ").";
+					error();
+				}
+				*length = substring(s->value.string_v, begin, n);
+				break;
+			}
+			case operation::Split: {
+				const auto s = stack_frame.back().top - 1;
+				const auto separator = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				if (s->type != Type::STRING || separator->type != Type::STRING) {
+					cerr << "Unsupported types for Split: " << s->type_of() << " and " << separator->type_of();
+					error();
+				}
+				const std::string sep(separator->value.string_v->view());
+				if (sep.empty()) {
+					cerr << "Split needs a non-empty separator.";
+					error();
+				}
+				esmel_string* origin = s->value.string_v;
+				// 先移入共享缓冲区，使下面取得的内容地址在切分过程中不变
+				if (origin->slice || origin->heap == objects.heap_id) origin->slice_owner();
+				const std::string_view content = origin->view();
+				// 先找出所有分隔符，再一次性分配全部的字符串
+				std::vector<size_t> ends;
+				for (size_t end = esmel_find(content, sep); end != esmel_npos; end = esmel_find(content, sep, end + sep.size())) {
+					ends.push_back(end);
+				}
+				ends.push_back(content.size());
+				auto result = objects.createArray();
+				auto& parts = result.value.array_v->v;
+				parts.reserve(ends.size());
+				objects.reserve_strings(ends.size());
+				size_t begin = 0;
+				for (const size_t end: ends) {
+					parts.push_back(substring(origin, begin, end - begin));
+					begin = end + sep.size();
+				}
+				objects.resized(result.value.array_v, 0);
+				*separator = result;
+				break;
+			}
+			case operation::GetAtUnchecked: {
+				// 编译期已证明 origin 是数组且下标在范围内
+				const auto origin = stack_frame.back().top - 1;
+				const auto index = stack_frame.back().top - 2;
+				stack_frame.back().top -= 1;
+				*index = origin->value.array_v->read()[index->value.int_v];
+				break;
+			}
+			case operation::SetAtUnchecked: {
+				const auto origin = stack_frame.back().top - 1;
+				const auto index = stack_frame.back().top - 2;
+				const auto target = stack_frame.back().top - 3;
+				stack_frame.back().top -= 3;
+				objects.writable(origin->value.array_v)[index->value.int_v] = *target;
 				break;
 			}
-			*/
 
 			default:
 				break;
 			}
 		}
-		// stack_frame.back().exec_stack.clear();
-		// cout << "Return " << line+1 << endl;
 		return line + 1;
 	}
 };
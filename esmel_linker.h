@@ -0,0 +1,88 @@
+#pragma once
+
+// 链接器：把多个模块合并为一个程序。
+// 按名字为函数分配全局 id（Main 为 0），后加入的模块中的同名函数覆盖之前的定义，与在一个文件中重新定义函数相同；
+// 合并字符串字面量；把调用的符号解析为函数 id 或原生函数。之后进行需要整个程序的优化。
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "esmel_callable.h"
+#include "esmel_module.h"
+#include "esmel_native.h"
+#include "esmel_optimizer.h"
+#include "esmel_stats.h"
+
+class esmel_linker {
+	std::vector<esmel_module> modules;
+
+public:
+	std::vector<esmel_function> functions;
+	std::vector<std::string> static_strs;
+
+	void add(esmel_module module) {
+		modules.push_back(std::move(module));
+	}
+
+	void link() {
+		// 全局函数 id 与定义它的模块、模块内的 id
+		std::unordered_map<std::string, uint64_t> ids = {{main_func_name, 0}};
+		std::vector<std::pair<size_t, uint64_t>> definitions = {{SIZE_MAX, 0}};
+		for (size_t m = 0; m < modules.size(); m++) {
+			const auto& module = modules[m];
+			for (uint64_t f = 0; f < module.functions.size(); f++) {
+				if (!module.exported[f]) continue;
+				const auto [found, inserted] = ids.emplace(module.symbols[f], definitions.size());
+				if (inserted) definitions.emplace_back(m, f);
+				else definitions[found->second] = {m, f};
+			}
+		}
+		if (definitions[0].first == SIZE_MAX) {
+			std::cerr << "Error: No module defines the Main function." << std::endl;
+			exit(-1);
+		}
+
+		std::unordered_map<std::string, uint64_t> strs;
+		functions.resize(definitions.size());
+		for (size_t id = 0; id < definitions.size(); id++) {
+			const auto& [m, f] = definitions[id];
+			const auto& module = modules[m];
+			auto& func = functions[id] = module.functions[f];
+			for (size_t j = 0; j < func.code.size(); j++) {
+				for (auto& [op, data]: func.code[j]) {
+					if (op == operation::GetStaticStr) {
+						const auto [found, inserted] = strs.emplace(module.static_strs[data], static_strs.size());
+						if (inserted) static_strs.push_back(module.static_strs[data]);
+						data = found->second;
+						continue;
+					}
+					if (op != operation::Call && op != operation::Spawn && op != operation::ParallelMap && op != operation::ParallelFor
+						&& op != operation::SortBy) continue;
+					const std::string& name = module.symbols[data];
+					const auto found = ids.find(name);
+					if (found != ids.end()) {
+						data = found->second;
+					} else if (const uint64_t native = esmel_find_native(name); op == operation::Call && native != UINT64_MAX) {
+						op = operation::CallNative;
+						data = native;
+						continue;
+					} else {
+						std::cerr << "Cannot find function \'" << name << "\'.\n\tat " << func.file_name << ':' << func.real_line_num[j];
+						exit(-1);
+					}
+					const auto& [callee_module, callee] = definitions[data];
+					if ((op == operation::ParallelMap || op == operation::ParallelFor || op == operation::SortBy)
+						&& modules[callee_module].functions[callee].arguments != 1) {
+						std::cerr << operation_names[static_cast<size_t>(op)] << " needs a function that takes exactly 1 argument.\n\tat " << func.file_name << ':' << func.real_line_num[j];
+						exit(-1);
+					}
+				}
+			}
+		}
+		optimize_program(functions);
+	}
+};
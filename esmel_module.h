@@ -0,0 +1,128 @@
+#pragma once
+
+// 模块：单独编译的一个源文件（.esmo 目标文件）。
+// 函数之间的调用以符号下标保存，由链接器按名字解析，因此修改一个模块不需要重新编译其它模块。
+// 运行多个源文件时，每个 a.esm 的编译结果缓存在 a.esmo 中，源文件未改变时直接读取。
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "esmel_binary.h"
+#include "esmel_callable.h"
+#include "esmel_compiler.h"
+
+constexpr char esmel_module_magic[8] = {'E', 'S', 'M', 'E', 'L', 'O', 'B', 'J'};
+constexpr uint32_t esmel_module_version = 2;
+
+struct esmel_module {
+	std::string source;							// 源文件路径
+	uint64_t source_hash = 0;					// 源文件内容的哈希，判断缓存是否有效
+	std::vector<esmel_function> functions;		// Call 等操作的操作数为 symbols 的下标，GetStaticStr 为 static_strs 的下标
+	std::vector<uint8_t> exported;				// 函数由本模块定义（未定义的 Main 不导出）
+	std::vector<std::string> symbols;			// 前 functions.size() 个为本模块的函数，其后为导入的函数
+	std::vector<std::string> static_strs;
+};
+
+// FNV-1a
+inline uint64_t esmel_source_hash(const std::string& content) {
+	uint64_t h = 14695981039346656037ull;
+	for (const char c: content) {
+		h ^= static_cast<uint8_t>(c);
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+inline bool esmel_read_source(const std::string& path, std::string& content) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) return false;
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	content = buffer.str();
+	return true;
+}
+
+// 编译一个源文件为模块，出错时与整个程序的编译相同，打印错误后退出
+inline esmel_module esmel_compile_module(std::string source, const uint64_t source_hash) {
+	esmel_compiler compiler;
+	compiler.allow_imports = true;
+	compiler.add_target(source);
+	compiler.compile();
+
+	esmel_module module;
+	module.source = source;
+	module.source_hash = source_hash;
+	module.functions = std::move(compiler.esmel_functions);
+	module.exported.resize(module.functions.size());
+	module.symbols.resize(module.functions.size());
+	for (const auto& [name, code]: compiler.preloaded_codes) {
+		module.symbols[code.id] = name;
+		module.exported[code.id] = code.defined || !code.code.empty();
+	}
+	module.symbols.insert(module.symbols.end(), compiler.imports.begin(), compiler.imports.end());
+	module.static_strs = std::move(compiler.static_strs);
+	return module;
+}
+
+inline bool esmel_write_module(const std::string& path, const esmel_module& module) {
+	esmel_binary_writer out;
+	out.put_header(esmel_module_magic, esmel_module_version);
+	out.put_string(module.source);
+	out.put<uint64_t>(module.source_hash);
+	out.put<uint64_t>(module.functions.size());
+	for (size_t i = 0; i < module.functions.size(); i++) {
+		out.put<uint8_t>(module.exported[i]);
+		out.put_function(module.functions[i]);
+	}
+	out.put<uint64_t>(module.symbols.size());
+	for (const auto& s: module.symbols) out.put_string(s);
+	out.put<uint64_t>(module.static_strs.size());
+	for (const auto& s: module.static_strs) out.put_string(s);
+	return out.save(path);
+}
+
+// 读取目标文件，文件不存在、损坏或来自不同的构建时返回 false
+inline bool esmel_read_module(const std::string& path, esmel_module& module) {
+	esmel_binary_reader in;
+	if (!in.map(path) || !in.expect(esmel_module_magic, esmel_module_version)) return false;
+	module.source = in.get_string();
+	module.source_hash = in.get<uint64_t>();
+	const uint64_t count = in.get_count(1);
+	module.functions.resize(count);
+	module.exported.resize(count);
+	for (size_t i = 0; i < count && in.ok; i++) {
+		module.exported[i] = in.get<uint8_t>();
+		module.functions[i] = in.get_function();
+	}
+	module.symbols.resize(in.get_count(sizeof(uint64_t)));
+	for (auto& s: module.symbols) s = in.get_string();
+	module.static_strs.resize(in.get_count(sizeof(uint64_t)));
+	for (auto& s: module.static_strs) s = in.get_string();
+	return in.ok && !module.functions.empty() && module.symbols.size() >= module.functions.size();
+}
+
+// 源文件对应的目标文件：a.esm -> a.esmo
+inline std::string esmel_module_path(const std::string& source) {
+	return std::filesystem::path(source).replace_extension(".esmo").string();
+}
+
+// 取得源文件的模块：目标文件来自同一源文件且内容未变时直接使用，否则重新编译并更新目标文件
+inline esmel_module esmel_load_module(const std::string& source) {
+	std::string content;
+	if (!esmel_read_source(source, content)) {
+		std::cerr << "Error: Cannot open file: " << source << std::endl;
+		exit(0);
+	}
+	const uint64_t hash = esmel_source_hash(content);
+	const std::string object = esmel_module_path(source);
+	esmel_module module;
+	if (esmel_read_module(object, module) && module.source == source && module.source_hash == hash) return module;
+	module = esmel_compile_module(source, hash);
+	// 缓存写入失败（如目录只读）不影响运行
+	esmel_write_module(object, module);
+	return module;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+// 原生函数：用 C++ 实现、可以像 Esmel 函数一样按名字调用的函数。
+// 在编译脚本之前注册；脚本中找不到同名的 Esmel 函数时，编译器按名字解析到原生函数。
+//
+// 原生函数直接取得运算栈上参数的区间（不复制），返回值写回参数所在的位置：
+//   EsmelObject my_len(esmel_native_context& ctx, esmel_native_args args) { ... }
+//   esmel_register_native("MyLen", 1, my_len);
+// 参数与返回值都是 Int / Float 的函数可以直接注册，类型检查与取值由生成的包装函数完成：
+//   int64_t gcd(int64_t a, int64_t b) { ... }
+//   esmel_register_native<gcd>("Gcd", true);
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "esmel_gc.h"
+#include "esmel_object.h"
+
+struct esmel_native_context {
+	EsmelObjectPool& objects;	// 用于创建字符串与数组（调用期间不会回收）
+	std::string error;			// 非空表示调用出错，解释器打印后以调用栈退出
+};
+
+// 运算栈上的参数。实参按从后到前的顺序入栈，这里按源代码中的顺序编号：args[0] 是第一个参数
+class esmel_native_args {
+	std::span<EsmelObject> values;
+
+public:
+	explicit esmel_native_args(const std::span<EsmelObject> stack) : values(stack) {}
+
+	EsmelObject& operator[](const size_t i) const {
+		return values[values.size() - 1 - i];
+	}
+
+	[[nodiscard]] size_t size() const {
+		return values.size();
+	}
+};
+
+using esmel_native_function = EsmelObject (*)(esmel_native_context&, esmel_native_args);
+
+struct esmel_native {
+	std::string name;
+	uint64_t arguments;
+	esmel_native_function function;
+	bool pure;		// 返回值只取决于参数且没有副作用（调用它的递归函数仍可被缓存）
+};
+
+// 已注册的原生函数，下标即 CallNative 的操作数
+inline std::vector<esmel_native>& esmel_natives() {
+	static std::vector<esmel_native> natives;
+	return natives;
+}
+
+// 按名字查找，未找到时返回 UINT64_MAX
+inline uint64_t esmel_find_native(const std::string_view name) {
+	const auto& natives = esmel_natives();
+	for (size_t i = 0; i < natives.size(); i++) {
+		if (natives[i].name == name) return i;
+	}
+	return UINT64_MAX;
+}
+
+// 注册原生函数，同名的函数会被替换。返回值便于在静态初始化中注册
+inline bool esmel_register_native(const std::string_view name, const uint64_t arguments, const esmel_native_function function,
+	const bool pure = false) {
+	auto& natives = esmel_natives();
+	const uint64_t found = esmel_find_native(name);
+	if (found != UINT64_MAX) natives[found] = {std::string(name), arguments, function, pure};
+	else natives.push_back({std::string(name), arguments, function, pure});
+	return true;
+}
+
+// 数值函数的包装：检查参数类型后直接以 int64_t / double 调用
+template <class T>
+concept esmel_numeric = std::is_same_v<T, int64_t> || std::is_same_v<T, double>;
+
+template <class T>
+struct esmel_numeric_signature;
+
+template <esmel_numeric R, esmel_numeric... Args>
+struct esmel_numeric_signature<R (*)(Args...)> {
+	static constexpr uint64_t arguments = sizeof...(Args);
+
+	template <class T>
+	static T value(const EsmelObject& obj) {
+		if constexpr (std::is_same_v<T, int64_t>) return obj.value.int_v;
+		else return obj.value.float_v;
+	}
+
+	template <auto F, size_t... I>
+	static EsmelObject call(esmel_native_context& context, const esmel_native_args args, std::index_sequence<I...>) {
+		constexpr Type types[] = {(std::is_same_v<Args, int64_t> ? Type::INT : Type::FLOAT)..., Type::UNDEFINED};
+		for (size_t i = 0; i < sizeof...(Args); i++) {
+			if (args[i].type != types[i]) {
+				context.error = "Argument " + std::to_string(i + 1) + " must be " + EsmelObject(types[i]).to_string()
+					+ ", but get: " + args[i].type_of();
+				return {};
+			}
+		}
+		return F(value<Args>(args[I])...);
+	}
+};
+
+template <auto F>
+EsmelObject esmel_numeric_native(esmel_native_context& context, const esmel_native_args args) {
+	using signature = esmel_numeric_signature<decltype(F)>;
+	return signature::template call<F>(context, args, std::make_index_sequence<signature::arguments>());
+}
+
+template <auto F>
+bool esmel_register_native(const std::string_view name, const bool pure = false) {
+	return esmel_register_native(name, esmel_numeric_signature<decltype(F)>::arguments, esmel_numeric_native<F>, pure);
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <list>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct EsmelObject;
@@ -10,8 +13,126 @@ enum class Type {
 	UNDEFINED, INT, FLOAT, BOOLEAN, STRING, ARRAY, TYPE
 };
 
-struct esmel_string {std::string v; bool marked;};
-struct esmel_array {std::vector<EsmelObject> v; bool marked;};
+// 对象池之外发生的内存增长（字节），如绳的展平；由对象池在检查堆大小时计入
+inline thread_local int64_t esmel_untracked_bytes = 0;
+
+// std::string 在堆上占用的字节数（短字符串存放在对象内部，不占用堆）
+inline uint64_t string_heap_bytes(const std::string& s) {
+	static const size_t inline_capacity = std::string().capacity();
+	return s.capacity() > inline_capacity ? s.capacity() + 1 : 0;
+}
+
+struct esmel_string {
+	std::string v;
+	std::shared_ptr<std::string> shared;	// Copy 后与副本共享的内容，非空时 v 不使用
+	bool marked = false;
+	uint16_t heap = 0;						// 所属的堆（并行工作线程各有一个堆）
+	uint32_t site = 0;						// 分配位置（开启内存分析时为分配位置的编号，0 表示未知）
+	// 绳（rope）结构：Link 得到的长字符串先只记录左右两段，读取内容时再惰性展平。
+	esmel_string* left = nullptr;
+	esmel_string* right = nullptr;
+	uint64_t length;				// 总长度，Len 不需要展平
+	// 切片：内容是 owner 保持存活的一段字节（只读映射的文件或其它字符串的共享内容），不复制
+	std::shared_ptr<const void> owner;
+	const char* slice = nullptr;
+
+	explicit esmel_string(std::string val) : v(std::move(val)), length(v.size()) {}
+	esmel_string(esmel_string* l, esmel_string* r) : left(l), right(r), length(l->length + r->length) {}
+	esmel_string(std::shared_ptr<const void> o, const char* data, const uint64_t n) : length(n), owner(std::move(o)), slice(data) {}
+
+	// 读取内容而不复制（绳仍需展平）
+	std::string_view view() {
+		if (left) flatten();
+		return flat_view();
+	}
+
+	// 读取为 std::string（必要时展平）；切片此时复制出自己的内容，不再引用原来的字节
+	const std::string& str() {
+		if (left) flatten();
+		if (slice) {
+			v.assign(slice, length);
+			owner.reset();
+			slice = nullptr;
+			esmel_untracked_bytes += static_cast<int64_t>(string_heap_bytes(v));
+		}
+		return shared ? *shared : v;
+	}
+
+	// 取得内容的持有者供切片引用：切片直接共用原来的持有者，自有的内容先移入共享的缓冲区（与 Copy 相同）。
+	// 之后 view() 返回的字节地址不再改变
+	std::shared_ptr<const void> slice_owner() {
+		if (left) flatten();
+		if (slice) return owner;
+		if (!shared) {
+			shared = std::make_shared<std::string>(std::move(v));
+			v = std::string();
+		}
+		return shared;
+	}
+
+	// 与另一个字符串对象共享内容
+	void share_with(esmel_string* other) {
+		if (left) flatten();
+		if (slice) {
+			other->owner = owner;
+			other->slice = slice;
+			other->length = length;
+			return;
+		}
+		if (!shared) {
+			shared = std::make_shared<std::string>(std::move(v));
+			v = std::string();
+		}
+		other->shared = shared;
+		other->length = length;
+	}
+
+	void flatten() {
+		// 用显式栈遍历，避免循环中反复 Link 形成的深链导致递归过深
+		std::string result;
+		result.reserve(length);
+		std::vector<const esmel_string*> pending = {right, left};
+		while (!pending.empty()) {
+			const esmel_string* s = pending.back();
+			pending.pop_back();
+			if (s->left) {
+				pending.push_back(s->right);
+				pending.push_back(s->left);
+			} else {
+				result += s->flat_view();
+			}
+		}
+		v = std::move(result);
+		left = right = nullptr;
+		esmel_untracked_bytes += static_cast<int64_t>(string_heap_bytes(v));
+	}
+
+	// 不是绳的字符串的内容
+	[[nodiscard]] std::string_view flat_view() const {
+		if (slice) return {slice, length};
+		return shared ? *shared : v;
+	}
+};
+struct esmel_array {
+	std::vector<EsmelObject> v;
+	std::shared_ptr<std::vector<EsmelObject>> shared;	// 写时复制：Copy 后与副本共享的元素，非空时 v 不使用
+	bool marked = false;
+	uint16_t heap = 0;									// 所属的堆
+	uint32_t site = 0;									// 分配位置
+
+	[[nodiscard]] const std::vector<EsmelObject>& read() const {
+		return shared ? *shared : v;
+	}
+
+	// 取得可修改的元素：与副本共享时先复制一份
+	std::vector<EsmelObject>& write() {
+		if (shared) [[unlikely]] detach();
+		return v;
+	}
+
+	void detach();
+	void share_with(esmel_array* other);
+};
 // struct esmel_map {unordered_map<EsmelObject, EsmelObject> v; list<EsmelObject> l; bool marked;};
 
 struct EsmelObject {
@@ -33,13 +154,14 @@ struct EsmelObject {
 		case Type::INT: return std::to_string(value.int_v);
 		case Type::FLOAT: return std::to_string(value.float_v);
 		case Type::BOOLEAN: return value.boolean_v ? "true" : "false";
-		case Type::STRING: return value.string_v->v;
+		case Type::STRING: return std::string(value.string_v->view());
 		case Type::ARRAY: {
 			std::string result = "[";
-			for (size_t i = 0; i < value.array_v->v.size(); ++i)
+			const auto& elements = value.array_v->read();
+			for (size_t i = 0; i < elements.size(); ++i)
 			{
-				result += value.array_v->v.at(i).to_string();
-				if (i < value.array_v->v.size() - 1)
+				result += elements[i].to_string();
+				if (i < elements.size() - 1)
 				{
 					result += ", ";
 				}
@@ -79,13 +201,18 @@ struct EsmelObject {
 		case Type::INT: return value.int_v == another.value.int_v;
 		case Type::FLOAT: return value.float_v == another.value.float_v;
 		case Type::BOOLEAN: return value.boolean_v == another.value.boolean_v;
-		case Type::STRING: return value.string_v->v == another.value.string_v->v;
+		case Type::STRING: {
+			if (value.string_v->length != another.value.string_v->length) return false;
+			return value.string_v->view() == another.value.string_v->view();
+		}
 		case Type::ARRAY:
 		{
-			if (value.array_v->v.size() != another.value.array_v->v.size()) return false;
-			for (size_t i = 0; i < value.array_v->v.size(); i++)
+			const auto& a = value.array_v->read();
+			const auto& b = another.value.array_v->read();
+			if (a.size() != b.size()) return false;
+			for (size_t i = 0; i < a.size(); i++)
 			{
-				if (!value.array_v->v.at(i).equal_to(another.value.array_v->v.at(i))) return false;
+				if (!a[i].equal_to(b[i])) return false;
 			}
 			return true;
 		}
@@ -130,3 +257,17 @@ struct EsmelObject {
 		value.type_v = val;
 	}
 };
+
+inline void esmel_array::detach() {
+	if (shared.use_count() == 1) v = std::move(*shared);
+	else v = *shared;
+	shared.reset();
+}
+
+inline void esmel_array::share_with(esmel_array* other) {
+	if (!shared) {
+		shared = std::make_shared<std::vector<EsmelObject>>(std::move(v));
+		v = std::vector<EsmelObject>();
+	}
+	other->shared = shared;
+}
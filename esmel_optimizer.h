@@ -0,0 +1,752 @@
+#pragma once
+
+// 编译期优化，作用于已编译的操作码。
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include "esmel_callable.h"
+#include "esmel_native.h"
+
+// 操作码对运算栈的影响
+struct stack_effect {
+	uint32_t pops;		// 弹出的值个数
+	uint32_t pushes;	// 压入的值个数
+};
+
+// 求操作码的栈影响。arity 为各函数的参数个数。
+// 返回 false 表示无法静态确定（外提后的缓存块由调用者整体处理）。
+inline bool op_stack_effect(const esmel_op_code& code, const std::vector<uint64_t>& arity, stack_effect& effect) {
+	switch (code.op) {
+	case operation::CreateInt: case operation::CreateFloat: case operation::CreateBoolean:
+	case operation::GetStaticStr: case operation::CreateUndefined: case operation::CreateType:
+	case operation::GetVar: case operation::Readln: case operation::GetTime: case operation::NewArray:
+	case operation::GetHeapSize: case operation::GetPeakHeapSize:
+	case operation::GetStaticStrLocal: case operation::NewArrayLocal:
+		effect = {0, 1};
+		return true;
+	case operation::SetVar: case operation::AddBy: case operation::SubBy: case operation::MulBy:
+	case operation::DivBy: case operation::ModBy: case operation::Print: case operation::Println:
+	case operation::If: case operation::Error: case operation::GotoUnless:
+		effect = {1, 0};
+		return true;
+	case operation::Input: case operation::Gc: case operation::Goto: case operation::Return: case operation::Yield:
+	case operation::Snapshot:
+		effect = {0, 0};
+		return true;
+	case operation::Add: case operation::Sub: case operation::Mul: case operation::Div: case operation::Mod:
+	case operation::Equal: case operation::And: case operation::Or:
+	case operation::Less: case operation::ELess: case operation::Greater: case operation::EGreater:
+	case operation::GetAt: case operation::GetAtUnchecked: case operation::Link: case operation::LinkLocal:
+	case operation::Split: case operation::Find: case operation::Contains:
+		effect = {2, 1};
+		return true;
+	case operation::Copy: case operation::CopyLocal: case operation::Typeof: case operation::Not: case operation::GetLength:
+	case operation::Await: case operation::Deserialize: case operation::ReadFile: case operation::Sort: case operation::Trim:
+		effect = {1, 1};
+		return true;
+	case operation::Append: case operation::Serialize:
+		effect = {2, 0};
+		return true;
+	case operation::SetAt: case operation::SetAtUnchecked:
+		effect = {3, 0};
+		return true;
+	case operation::Substring: case operation::Replace:
+		effect = {3, 1};
+		return true;
+	case operation::Call: case operation::Spawn: case operation::ParallelMap: case operation::ParallelFor: case operation::SortBy:
+		if (code.data >= arity.size()) return false;	// 其它模块中的函数，链接前不知道参数个数
+		effect = {static_cast<uint32_t>(arity[code.data]), 1};
+		return true;
+	case operation::CallNative:
+		effect = {static_cast<uint32_t>(esmel_natives()[code.data].arguments), 1};
+		return true;
+	default:
+		return false;
+	}
+}
+
+// 一行执行时运算栈上最多同时存在的临时值个数。无法确定栈影响的操作码按只压入一个值计算，结果可能偏大
+inline size_t max_stack_depth(const std::vector<esmel_op_code>& line, const std::vector<uint64_t>& arity) {
+	size_t depth = 0, peak = 0;
+	for (const auto& code: line) {
+		stack_effect effect{};
+		if (!op_stack_effect(code, arity, effect)) effect = {0, 1};
+		depth = depth > effect.pops ? depth - effect.pops : 0;
+		depth += effect.pushes;
+		peak = std::max(peak, depth);
+	}
+	return peak;
+}
+
+// 是否是给局部变量（data）赋值的操作码
+inline bool assigns_variable(const operation op) {
+	switch (op) {
+	case operation::SetVar: case operation::AddBy: case operation::SubBy: case operation::MulBy:
+	case operation::DivBy: case operation::ModBy: case operation::Input:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// 向前找到第 line 行之前最近一次给 var 赋值的行，没有时返回 UINT64_MAX
+inline uint64_t last_assignment_before(const esmel_function& func, uint64_t line, const uint64_t var) {
+	while (line-- > 0) {
+		for (const auto& [op, data]: func.code[line]) {
+			if (data == var && assigns_variable(op)) return line;
+		}
+	}
+	return UINT64_MAX;
+}
+
+// 是否有循环外的跳转进入循环（包括直接跳到循环头而绕过前置行）
+inline bool entered_from_outside(const esmel_function& func, const esmel_loop& loop) {
+	for (uint64_t l = 0; l < func.code.size(); l++) {
+		if (l >= loop.header && l <= loop.end) continue;
+		for (const auto& [op, data]: func.code[l]) {
+			if ((op == operation::Goto || op == operation::GotoUnless) && data >= loop.header && data <= loop.end) return true;
+		}
+	}
+	return false;
+}
+
+// 外提循环不变量。
+// 循环内不依赖循环中被赋值的变量、且没有副作用的表达式（如 Len arr、* 60 60）改为：
+//   LoadInvariant slot|跳过长度 <表达式> StoreInvariant slot
+// 前置行把缓存槽位清为 Undefined；表达式第一次执行时照常求值并写入缓存，之后的迭代直接取值并跳过表达式。
+// 第一次求值仍在原位置发生，因此零次迭代的循环与求值出错时的行为都与优化前一致。
+inline void hoist_loop_invariants(esmel_function& func, const std::vector<uint64_t>& arity) {
+	// 外层循环先处理，使不变量尽量提到最外层
+	std::vector<esmel_loop> loops = func.loops;
+	std::ranges::sort(loops, [](const esmel_loop& a, const esmel_loop& b) { return a.header < b.header; });
+
+	for (const auto& loop: loops) {
+		// 从循环外跳入循环（绕过前置行）时缓存可能是上一次进入循环留下的，这样的循环不做优化
+		if (entered_from_outside(func, loop)) continue;
+
+		// 循环中被赋值的变量，以及是否可能修改数组（调用的函数与切换到的其它协程也可能修改）
+		std::unordered_set<uint64_t> assigned;
+		bool mutates = false;
+		for (uint64_t l = loop.header; l <= loop.end; l++) {
+			for (const auto& [op, data]: func.code[l]) {
+				switch (op) {
+				case operation::SetVar: case operation::AddBy: case operation::SubBy: case operation::MulBy:
+				case operation::DivBy: case operation::ModBy: case operation::Input:
+					assigned.insert(data);
+					break;
+				case operation::SetAt: case operation::SetAtUnchecked: case operation::Append: case operation::Call:
+				case operation::Yield: case operation::Await: case operation::ParallelMap: case operation::ParallelFor:
+				case operation::CallNative: case operation::Sort: case operation::SortBy:
+					mutates = true;
+					break;
+				default:
+					break;
+				}
+			}
+		}
+
+		auto invariant_op = [&](const esmel_op_code& code) {
+			switch (code.op) {
+			case operation::CreateInt: case operation::CreateFloat: case operation::CreateBoolean:
+			case operation::CreateUndefined: case operation::CreateType:
+			case operation::Add: case operation::Sub: case operation::Mul: case operation::Div: case operation::Mod:
+			case operation::Equal: case operation::And: case operation::Or: case operation::Not:
+			case operation::Less: case operation::ELess: case operation::Greater: case operation::EGreater:
+			case operation::Typeof: case operation::Find: case operation::Contains:
+				return true;
+			case operation::GetVar:
+				return !assigned.contains(code.data);
+			case operation::GetLength: case operation::GetAt: case operation::GetAtUnchecked:
+				return !mutates;
+			default:
+				return false;
+			}
+		};
+
+		// 相同的不变量共用一个缓存槽位
+		std::vector<std::pair<std::vector<esmel_op_code>, uint64_t>> slots;
+		std::vector<esmel_op_code> preheader;
+
+		for (uint64_t l = loop.header; l <= loop.end; l++) {
+			auto& line = func.code[l];
+
+			// 栈上每个值对应的操作码区间
+			struct value {
+				size_t begin, end;
+				bool invariant;
+				bool compound;		// 含有运算，单独的常量或变量不值得外提
+			};
+			std::vector<value> stack;
+			std::vector<std::pair<size_t, size_t>> candidates;
+			auto settle = [&](const value& v) {
+				if (v.invariant && v.compound) candidates.emplace_back(v.begin, v.end);
+			};
+
+			for (size_t i = 0; i < line.size(); i++) {
+				if (line[i].op == operation::LoadInvariant) {
+					// 外层循环已外提的表达式，整体视为一个不变的值
+					const size_t end = i + (line[i].data >> 32) + 1;
+					stack.push_back({i, end, true, false});
+					i = end - 1;
+					continue;
+				}
+				stack_effect effect{};
+				if (!op_stack_effect(line[i], arity, effect) || stack.size() < effect.pops) break;
+
+				value result{i, i + 1, invariant_op(line[i]), effect.pops > 0};
+				std::vector<value> operands(stack.end() - effect.pops, stack.end());
+				stack.resize(stack.size() - effect.pops);
+				for (const auto& v: operands) {
+					result.begin = std::min(result.begin, v.begin);
+					result.invariant = result.invariant && v.invariant;
+				}
+				if (!result.invariant) {
+					for (const auto& v: operands) settle(v);
+				}
+				if (effect.pushes) stack.push_back(result);
+				if (line[i].op == operation::Goto || line[i].op == operation::Return) break;
+			}
+			for (const auto& v: stack) settle(v);
+			if (candidates.empty()) continue;
+
+			// 从后向前改写，保持前面区间的下标不变
+			std::ranges::sort(candidates, std::greater<>());
+			for (const auto& [begin, end]: candidates) {
+				std::vector<esmel_op_code> expression(line.begin() + static_cast<ptrdiff_t>(begin), line.begin() + static_cast<ptrdiff_t>(end));
+				uint64_t slot = UINT64_MAX;
+				for (const auto& [code, s]: slots) {
+					if (code.size() == expression.size() && std::ranges::equal(code, expression, [](const esmel_op_code& a, const esmel_op_code& b) {
+						return a.op == b.op && a.data == b.data;
+					})) {
+						slot = s;
+						break;
+					}
+				}
+				if (slot == UINT64_MAX) {
+					slot = func.variable_count++;
+					slots.emplace_back(std::move(expression), slot);
+					preheader.push_back({operation::CreateUndefined, 0});
+					preheader.push_back({operation::SetVar, slot});
+				}
+				line.insert(line.begin() + static_cast<ptrdiff_t>(end), {operation::StoreInvariant, slot});
+				line.insert(line.begin() + static_cast<ptrdiff_t>(begin), {operation::LoadInvariant, slot | ((end - begin + 1) << 32)});
+			}
+		}
+
+		auto& pre = func.code[loop.preheader];
+		pre.insert(pre.end(), preheader.begin(), preheader.end());
+	}
+}
+
+// 只会被赋值为数组的局部变量：每次赋值都是 NewArray 或对这样的变量 Copy，且不是参数。
+// 这样的变量只可能是数组或尚未赋值的 Undefined。
+inline std::vector<bool> array_variables(const esmel_function& func) {
+	std::vector<bool> is_array(func.variable_count, true);
+	for (uint64_t i = 0; i < func.arguments && i < is_array.size(); i++) is_array[i] = false;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (const auto& line: func.code) {
+			for (size_t k = 0; k < line.size(); k++) {
+				const auto [op, data] = line[k];
+				bool array_assignment = false;
+				switch (op) {
+				case operation::SetVar:
+					// SetVar 的操作数即紧邻的前一个操作码所产生的值
+					array_assignment = k >= 1 && (line[k-1].op == operation::NewArray
+						|| (k >= 2 && line[k-1].op == operation::Copy && line[k-2].op == operation::GetVar && is_array[line[k-2].data]));
+					break;
+				case operation::AddBy: case operation::SubBy: case operation::MulBy:
+				case operation::DivBy: case operation::ModBy: case operation::Input: case operation::StoreInvariant:
+					break;
+				default:
+					continue;
+				}
+				if (!array_assignment && is_array[data]) {
+					is_array[data] = false;
+					changed = true;
+				}
+			}
+		}
+	}
+	return is_array;
+}
+
+// 消除计数循环中数组访问的类型与下标检查。
+// 对形如
+//   Set i <非负整数>
+//   While Less? i Len arr        (或 Greater? Len arr i)
+//       ... Get arr i / Put arr i v ...
+//       Add i <步长>
+//   End
+// 的循环，若 arr 只会是数组且在循环中不被重新赋值、i 在循环中只会加上 0 到 max_unchecked_step 之间的整数常量，
+// 则从循环头到第一次修改 i 之前的 Get arr i 与 Put arr i v 一定合法（数组只会增长，不会变短），
+// 改为不做检查的 GetAtUnchecked / SetAtUnchecked。其余访问保留原有检查与报错。
+// 数组长度远小于 2^62，i < Len arr 时加上不超过 2^32 的步长不会溢出成负数。
+constexpr int64_t max_unchecked_step = int64_t{1} << 32;
+
+inline void eliminate_bounds_checks(esmel_function& func) {
+	if (func.loops.empty()) return;
+	const std::vector<bool> is_array = array_variables(func);
+
+	for (const auto& loop: func.loops) {
+		if (entered_from_outside(func, loop)) continue;
+
+		// 识别循环头：i < Len arr
+		const auto& header = func.code[loop.header];
+		if (header.size() != 5 || header[4].op != operation::GotoUnless) continue;
+		uint64_t index_var, array_var;
+		if (header[0].op == operation::GetVar && header[1].op == operation::GetLength
+			&& header[2].op == operation::GetVar && header[3].op == operation::Less) {
+			array_var = header[0].data;
+			index_var = header[2].data;
+		} else if (header[0].op == operation::GetVar && header[1].op == operation::GetVar
+			&& header[2].op == operation::GetLength && header[3].op == operation::Greater) {
+			index_var = header[0].data;
+			array_var = header[1].data;
+		} else {
+			continue;
+		}
+		if (index_var == array_var || !is_array[array_var]) continue;
+
+		// 进入循环前 i 必须被赋值为非负整数：向前找到最近一次赋值，且它与循环之间没有跳转目标
+		const uint64_t set_line = last_assignment_before(func, loop.preheader, index_var);
+		if (set_line == UINT64_MAX) continue;
+		const auto& init = func.code[set_line];
+		if (init.size() != 2 || init[0].op != operation::CreateInt || std::bit_cast<int64_t>(init[0].data) < 0
+			|| init[1].op != operation::SetVar) continue;
+		bool jumped_into = false;
+		for (const auto& line: func.code) {
+			for (const auto& [op, data]: line) {
+				if ((op == operation::Goto || op == operation::GotoUnless) && data > set_line && data <= loop.preheader) jumped_into = true;
+			}
+		}
+		if (jumped_into) continue;
+
+		// 循环中 i 只能以 Add i <步长> 修改，arr 不被赋值；记录第一次修改 i 的位置
+		bool body_ok = true;
+		uint64_t first_line = loop.end + 1;
+		size_t first_pos = 0;
+		for (uint64_t l = loop.header; l <= loop.end && body_ok; l++) {
+			const auto& line = func.code[l];
+			for (size_t k = 0; k < line.size(); k++) {
+				const auto [op, data] = line[k];
+				if (!assigns_variable(op)) continue;
+				if (data == array_var) body_ok = false;
+				if (data != index_var) continue;
+				if (op != operation::AddBy || k == 0 || line[k-1].op != operation::CreateInt
+					|| std::bit_cast<int64_t>(line[k-1].data) < 0 || std::bit_cast<int64_t>(line[k-1].data) > max_unchecked_step) {
+					body_ok = false;
+				} else if (l < first_line) {
+					first_line = l;
+					first_pos = k;
+				}
+			}
+		}
+		if (!body_ok) continue;
+		// 修改 i 之后跳回到修改之前（而不经过循环头）时，同一次迭代内 i 可能已越界
+		for (uint64_t l = first_line; l <= loop.end && body_ok; l++) {
+			for (const auto& [op, data]: func.code[l]) {
+				if ((op == operation::Goto || op == operation::GotoUnless) && data > loop.header && data <= first_line) body_ok = false;
+			}
+		}
+		if (!body_ok) continue;
+
+		for (uint64_t l = loop.header + 1; l <= first_line && l <= loop.end; l++) {
+			auto& line = func.code[l];
+			const size_t limit = l == first_line ? first_pos : line.size();
+			for (size_t k = 2; k < limit; k++) {
+				if (line[k-2].op != operation::GetVar || line[k-2].data != index_var
+					|| line[k-1].op != operation::GetVar || line[k-1].data != array_var) continue;
+				if (line[k].op == operation::GetAt) line[k].op = operation::GetAtUnchecked;
+				else if (line[k].op == operation::SetAt) line[k].op = operation::SetAtUnchecked;
+			}
+		}
+	}
+}
+
+// 逃逸分析：找出不会逃出栈帧的分配（字符串字面量、NewArray、Copy、Link），改为分配在栈帧区域中。
+// 值在以下情况下逃逸：作为参数传给其它函数、存入数组（Put/Append 的值）、
+// 行结束时仍留在栈上（可能成为函数的返回值），以及存入会逃逸的变量。
+// Link 得到的绳会引用两段操作数，因此其操作数与结果一同逃逸。
+// 最后一个局部变量可能在行不留下值时被当作返回值，视为逃逸。
+inline void allocate_in_regions(esmel_function& func, const std::vector<uint64_t>& arity) {
+	struct site {
+		uint64_t line;
+		size_t pos;
+	};
+	// 栈上的值可能是哪些分配点创建的对象，或来自哪些变量
+	struct value {
+		std::vector<uint32_t> sites;
+		std::vector<uint64_t> vars;
+	};
+	std::vector<site> sites;
+	std::vector<bool> site_escapes;
+	std::vector<std::vector<uint32_t>> var_sites(func.variable_count);		// 赋值给变量的分配点
+	std::vector<std::vector<uint64_t>> var_vars(func.variable_count);		// 赋值给变量的其它变量
+	std::vector<bool> var_escapes(func.variable_count);
+	std::vector<uint64_t> escaped_vars;
+
+	auto escape_var = [&](const uint64_t var) {
+		if (var_escapes[var]) return;
+		var_escapes[var] = true;
+		escaped_vars.push_back(var);
+	};
+	auto escape = [&](const value& v) {
+		for (const uint32_t s: v.sites) site_escapes[s] = true;
+		for (const uint64_t var: v.vars) escape_var(var);
+	};
+	auto new_site = [&](const uint64_t line, const size_t pos) {
+		sites.push_back({line, pos});
+		site_escapes.push_back(false);
+		return static_cast<uint32_t>(sites.size() - 1);
+	};
+	if (func.variable_count) escape_var(func.variable_count - 1);
+
+	for (uint64_t l = 0; l < func.code.size(); l++) {
+		const auto& line = func.code[l];
+		std::vector<value> stack;
+		bool opaque = false;		// 遇到无法分析的操作码后，本行其余的分配与变量均视为逃逸
+		for (size_t i = 0; i < line.size(); i++) {
+			const auto [op, data] = line[i];
+			stack_effect effect{};
+			if (!opaque && op == operation::LoadInvariant) {
+				// 外提的不变量中没有分配
+				stack.emplace_back();
+				i += data >> 32;
+				continue;
+			}
+			if (!opaque && (!op_stack_effect(line[i], arity, effect) || stack.size() < effect.pops)) {
+				for (const auto& v: stack) escape(v);
+				stack.clear();
+				opaque = true;
+			}
+			if (opaque) {
+				if (op == operation::GetVar || assigns_variable(op)) escape_var(data);
+				continue;
+			}
+
+			std::vector<value> operands(stack.end() - effect.pops, stack.end());
+			stack.resize(stack.size() - effect.pops);
+			value result;
+			switch (op) {
+			case operation::GetStaticStr: case operation::NewArray: case operation::Copy:
+				result.sites.push_back(new_site(l, i));
+				break;
+			case operation::Link:
+				result.sites.push_back(new_site(l, i));
+				for (const auto& v: operands) {
+					result.sites.insert(result.sites.end(), v.sites.begin(), v.sites.end());
+					result.vars.insert(result.vars.end(), v.vars.begin(), v.vars.end());
+				}
+				break;
+			case operation::GetVar:
+				result.vars.push_back(data);
+				break;
+			case operation::SetVar:
+				var_sites[data].insert(var_sites[data].end(), operands[0].sites.begin(), operands[0].sites.end());
+				var_vars[data].insert(var_vars[data].end(), operands[0].vars.begin(), operands[0].vars.end());
+				break;
+			case operation::SetAt: case operation::SetAtUnchecked: case operation::Append:
+				// 存入数组的值逃逸，数组与下标不逃逸
+				escape(operands[0]);
+				break;
+			case operation::If: case operation::GotoUnless:
+				// 条件为假时本行在此结束，栈上剩余的值可能成为返回值
+				for (const auto& v: stack) escape(v);
+				break;
+			case operation::Print: case operation::Println: case operation::Error:
+			case operation::GetLength: case operation::Typeof: case operation::Equal:
+			case operation::Less: case operation::ELess: case operation::Greater: case operation::EGreater:
+			case operation::Add: case operation::Sub: case operation::Mul: case operation::Div: case operation::Mod:
+			case operation::And: case operation::Or: case operation::Not:
+			case operation::GetAt: case operation::GetAtUnchecked:
+			case operation::Serialize: case operation::Deserialize: case operation::ReadFile:
+			case operation::Substring: case operation::Split: case operation::Find: case operation::Contains:
+				// 只读取操作数，结果不引用操作数（切片引用的是内容的持有者，不是字符串对象）
+				break;
+			default:
+				for (const auto& v: operands) escape(v);
+				break;
+			}
+			if (effect.pushes) stack.push_back(std::move(result));
+			if (op == operation::Goto || op == operation::Return) break;
+		}
+		for (const auto& v: stack) escape(v);
+	}
+
+	// 逃逸的变量使赋给它的所有值逃逸
+	while (!escaped_vars.empty()) {
+		const uint64_t var = escaped_vars.back();
+		escaped_vars.pop_back();
+		for (const uint32_t s: var_sites[var]) site_escapes[s] = true;
+		for (const uint64_t source: var_vars[var]) escape_var(source);
+	}
+
+	for (uint32_t s = 0; s < sites.size(); s++) {
+		if (site_escapes[s]) continue;
+		auto& code = func.code[sites[s].line][sites[s].pos];
+		switch (code.op) {
+		case operation::GetStaticStr: code.op = operation::GetStaticStrLocal; break;
+		case operation::NewArray: code.op = operation::NewArrayLocal; break;
+		case operation::Copy: code.op = operation::CopyLocal; break;
+		case operation::Link: code.op = operation::LinkLocal; break;
+		default: break;
+		}
+	}
+}
+
+// 函数是否只修改自己创建的数组（即只对 array_variables 中的变量 Put / Append）
+inline bool mutates_only_own_arrays(const esmel_function& func) {
+	const std::vector<bool> is_array = array_variables(func);
+	for (const auto& line: func.code) {
+		for (size_t k = 0; k < line.size(); k++) {
+			switch (line[k].op) {
+			case operation::SetAt: case operation::SetAtUnchecked: case operation::Append:
+			case operation::Sort: case operation::SortBy:
+				// 被修改的数组即紧邻的前一个操作码所产生的值
+				if (k == 0 || line[k-1].op != operation::GetVar || !is_array[line[k-1].data]) return false;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+// 找出可以缓存返回值的函数：纯函数（没有输入输出、不读取时间与堆状态、不切换协程、
+// 不修改参数中的数组，且只调用纯函数与标记为纯的原生函数），并且是递归的（直接或间接调用自身）。
+// 纯函数的返回值只取决于参数，缓存对程序不可见；只有递归函数才可能以相同的参数被反复调用。
+inline void find_memoizable_functions(std::vector<esmel_function>& functions) {
+	const size_t n = functions.size();
+	std::vector<std::vector<uint32_t>> callees(n);
+	std::vector<bool> pure(n, true);
+	for (size_t f = 0; f < n; f++) {
+		for (const auto& line: functions[f].code) {
+			for (const auto& [op, data]: line) {
+				switch (op) {
+				case operation::Call: case operation::SortBy:
+					callees[f].push_back(static_cast<uint32_t>(data));
+					break;
+				case operation::Print: case operation::Println: case operation::Readln: case operation::Input:
+				case operation::GetTime: case operation::Gc: case operation::GetHeapSize: case operation::GetPeakHeapSize:
+				case operation::Spawn: case operation::Yield: case operation::Await:
+				case operation::ParallelMap: case operation::ParallelFor: case operation::Snapshot:
+				case operation::Serialize: case operation::Deserialize: case operation::ReadFile:
+					pure[f] = false;
+					break;
+				case operation::CallNative:
+					if (!esmel_natives()[data].pure) pure[f] = false;
+					break;
+				default:
+					break;
+				}
+			}
+		}
+		if (pure[f] && !mutates_only_own_arrays(functions[f])) pure[f] = false;
+	}
+	// 调用了非纯函数的函数也不是纯函数
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t f = 0; f < n; f++) {
+			if (!pure[f]) continue;
+			for (const uint32_t g: callees[f]) {
+				if (!pure[g]) {
+					pure[f] = false;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+	for (size_t f = 0; f < n; f++) {
+		if (!pure[f] || functions[f].arguments == 0 || functions[f].arguments > memo_max_arguments) continue;
+		// 从 f 的callee出发能否回到 f
+		std::vector<bool> seen(n, false);
+		std::vector<uint32_t> pending = callees[f];
+		while (!pending.empty() && !functions[f].memoize) {
+			const uint32_t g = pending.back();
+			pending.pop_back();
+			if (seen[g]) continue;
+			seen[g] = true;
+			if (g == f) functions[f].memoize = true;
+			pending.insert(pending.end(), callees[g].begin(), callees[g].end());
+		}
+	}
+}
+
+// 局部变量槽位的集合（位图）
+using slot_set = std::vector<uint64_t>;
+
+inline bool slot_contains(const slot_set& set, const uint64_t slot) {
+	return set[slot / 64] >> (slot % 64) & 1;
+}
+
+// 读写局部变量槽位的操作码：读取（含先读后写）与只写
+inline bool reads_slot(const operation op) {
+	switch (op) {
+	case operation::GetVar: case operation::AddBy: case operation::SubBy: case operation::MulBy:
+	case operation::DivBy: case operation::ModBy: case operation::LoadInvariant:
+		return true;
+	default:
+		return false;
+	}
+}
+
+inline bool writes_slot(const operation op) {
+	return assigns_variable(op) || op == operation::StoreInvariant;
+}
+
+// 操作码所用的槽位（LoadInvariant 的高 32 位是跳过的长度）
+inline uint64_t slot_of(const esmel_op_code& code) {
+	return code.op == operation::LoadInvariant ? code.data & UINT32_MAX : code.data;
+}
+
+// 活跃变量分析：live[l][k] 为第 l 行执行第 k 个操作码之前、之后可能被读取的槽位，live[l][行长度] 为行末。
+// 行内的控制流：Goto 跳到目标行，GotoUnless 可能跳到目标行，If 条件为假时转到下一行，
+// Return 与 Error 结束函数，LoadInvariant 命中缓存时跳过表达式。
+inline std::vector<std::vector<slot_set>> analyze_liveness(const esmel_function& func) {
+	const size_t n = func.code.size();
+	const size_t words = (func.variable_count + 63) / 64;
+	const slot_set empty(words);
+	std::vector<std::vector<slot_set>> live(n);
+	for (size_t l = 0; l < n; l++) live[l].assign(func.code[l].size() + 1, empty);
+	// 执行完最后一行时 run 返回栈顶的值，即最高的槽位，因此它在函数末尾仍被读取
+	slot_set exit = empty;
+	if (func.variable_count) exit[(func.variable_count - 1) / 64] |= 1ull << ((func.variable_count - 1) % 64);
+	auto line_entry = [&](const uint64_t l) -> const slot_set& {
+		return l < n ? live[l][0] : exit;
+	};
+	auto unite = [](slot_set& a, const slot_set& b) {
+		for (size_t i = 0; i < a.size(); i++) a[i] |= b[i];
+	};
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t l = n; l-- > 0;) {
+			const auto& line = func.code[l];
+			auto& at = live[l];
+			at[line.size()] = line_entry(l + 1);
+			for (size_t k = line.size(); k-- > 0;) {
+				const auto& code = line[k];
+				slot_set before;
+				switch (code.op) {
+				case operation::Goto:
+					before = line_entry(code.data);
+					break;
+				case operation::Return: case operation::Error:
+					before = empty;
+					break;
+				default:
+					before = at[k + 1];
+					break;
+				}
+				if (code.op == operation::GotoUnless) unite(before, line_entry(code.data));
+				if (code.op == operation::If) unite(before, line_entry(l + 1));
+				if (code.op == operation::LoadInvariant) unite(before, at[std::min(k + 1 + (code.data >> 32), line.size())]);
+				const uint64_t slot = slot_of(code);
+				if (writes_slot(code.op)) before[slot / 64] &= ~(1ull << (slot % 64));
+				if (reads_slot(code.op)) before[slot / 64] |= 1ull << (slot % 64);
+				if (k == 0 && before != at[0]) changed = true;
+				at[k] = std::move(before);
+			}
+		}
+	}
+	return live;
+}
+
+// 为局部变量分配栈帧槽位：生存期不重叠的变量共用一个槽位，以缩小栈帧。
+// 参数的槽位固定；可能在赋值之前被读取的变量（读到的是 Undefined）不使用参数的槽位，因为只有其余的槽位在调用时被清空。
+// 编号最大的变量是执行完最后一行时的返回值，它固定使用最高的槽位。
+// 之后按新的槽位生成栈图。需在其它使用变量编号的优化之后进行。
+inline void allocate_frame_slots(esmel_function& func) {
+	const uint64_t count = func.variable_count;
+	if (count == 0) return;
+	const auto live = analyze_liveness(func);
+	const slot_set& entry = live.empty() ? slot_set((count + 63) / 64) : live[0][0];
+
+	// 冲突：写入一个变量时，之后仍会被读取的其它变量；函数开始时同时存在的变量
+	std::vector<slot_set> conflicts(count, slot_set((count + 63) / 64));
+	auto conflict = [&](const uint64_t a, const uint64_t b) {
+		if (a == b) return;
+		conflicts[a][b / 64] |= 1ull << (b % 64);
+		conflicts[b][a / 64] |= 1ull << (a % 64);
+	};
+	for (size_t l = 0; l < func.code.size(); l++) {
+		const auto& line = func.code[l];
+		for (size_t k = 0; k < line.size(); k++) {
+			if (!writes_slot(line[k].op)) continue;
+			const auto& after = live[l][k + 1];
+			for (uint64_t v = 0; v < count; v++) {
+				if (slot_contains(after, v)) conflict(line[k].data, v);
+			}
+		}
+	}
+	for (uint64_t a = 0; a < count; a++) {
+		if (a >= func.arguments && !slot_contains(entry, a)) continue;
+		for (uint64_t b = 0; b < count; b++) {
+			if (b < func.arguments || slot_contains(entry, b)) conflict(a, b);
+		}
+	}
+
+	// 贪心着色：参数的槽位为其编号，其余变量取不与冲突变量相同的最小槽位，返回值变量最后放在最高的槽位
+	std::vector<uint64_t> slot(count, UINT64_MAX);
+	uint64_t slots = func.arguments;
+	const uint64_t result = count - 1;
+	for (uint64_t v = 0; v < count; v++) {
+		if (v < func.arguments) {
+			slot[v] = v;
+			continue;
+		}
+		if (v == result) break;
+		std::vector<bool> taken(count, false);
+		for (uint64_t u = 0; u < count; u++) {
+			if (slot[u] != UINT64_MAX && slot_contains(conflicts[v], u)) taken[slot[u]] = true;
+		}
+		uint64_t s = slot_contains(entry, v) ? func.arguments : 0;
+		while (taken[s]) s++;
+		slot[v] = s;
+		slots = std::max(slots, s + 1);
+	}
+	if (result >= func.arguments) slot[result] = slots++;
+
+	for (auto& line: func.code) {
+		for (auto& code: line) {
+			if (!reads_slot(code.op) && !writes_slot(code.op)) continue;
+			if (code.op == operation::LoadInvariant) code.data = (code.data & ~uint64_t{UINT32_MAX}) | slot[code.data & UINT32_MAX];
+			else code.data = slot[code.data];
+		}
+	}
+	func.variable_count = slots;
+
+	// 栈图：一行中任意位置活跃的槽位（调用在行中发生，调用者停在所在的行）
+	func.stack_maps.assign(func.code.size(), {});
+	const auto packed = analyze_liveness(func);
+	for (size_t l = 0; l < func.code.size(); l++) {
+		for (uint32_t s = 0; s < slots; s++) {
+			if (std::ranges::any_of(packed[l], [s](const slot_set& set) { return slot_contains(set, s); })) func.stack_maps[l].push_back(s);
+		}
+	}
+}
+
+// 只需要被调用函数参数个数的优化，按需编译时逐个函数进行。在消除下标检查之后进行。
+inline void optimize_function(esmel_function& func, const std::vector<uint64_t>& arity) {
+	hoist_loop_invariants(func, arity);
+	allocate_in_regions(func, arity);
+	allocate_frame_slots(func);
+}
+
+// 需要整个程序的优化（要知道每个被调用函数的参数个数与代码）。在消除下标检查之后进行。
+inline void optimize_program(std::vector<esmel_function>& functions) {
+	std::vector<uint64_t> arity(functions.size());
+	for (size_t i = 0; i < functions.size(); i++) arity[i] = functions[i].arguments;
+	find_memoizable_functions(functions);
+	for (auto& func: functions) optimize_function(func, arity);
+}
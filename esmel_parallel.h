@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 并行执行使用的线程池。run(job) 在每个线程上调用一次 job(线程编号)，
+// 调用 run 的线程自身作为 0 号线程参与，全部完成后返回。
+class EsmelThreadPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start, finish;
+	const std::function<void(size_t)>* job = nullptr;
+	uint64_t generation = 0;
+	size_t running = 0;
+	bool stopping = false;
+
+	void loop(const size_t index) {
+		uint64_t seen = 0;
+		while (true) {
+			const std::function<void(size_t)>* current;
+			{
+				std::unique_lock lock(mutex);
+				start.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping) return;
+				seen = generation;
+				current = job;
+			}
+			(*current)(index);
+			{
+				std::lock_guard lock(mutex);
+				if (--running == 0) finish.notify_one();
+			}
+		}
+	}
+
+public:
+	explicit EsmelThreadPool(const size_t size) {
+		for (size_t i = 1; i < size; i++) {
+			threads.emplace_back(&EsmelThreadPool::loop, this, i);
+		}
+	}
+
+	EsmelThreadPool(const EsmelThreadPool&) = delete;
+	EsmelThreadPool& operator=(const EsmelThreadPool&) = delete;
+
+	~EsmelThreadPool() {
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		start.notify_all();
+		for (auto& t: threads) t.join();
+	}
+
+	[[nodiscard]] size_t size() const {
+		return threads.size() + 1;
+	}
+
+	void run(const std::function<void(size_t)>& f) {
+		{
+			std::lock_guard lock(mutex);
+			job = &f;
+			running = threads.size();
+			generation++;
+		}
+		start.notify_all();
+		f(0);
+		std::unique_lock lock(mutex);
+		finish.wait(lock, [&] { return running == 0; });
+	}
+};
+
+// 工作窃取的下标区间。每个线程从自己区间的前端按块取任务，自己的区间取完后，
+// 从其它线程剩余区间的后半段窃取。区间打包在一个64位原子量中（高32位为起点，低32位为终点）。
+class EsmelWorkRanges {
+	struct alignas(64) range {
+		std::atomic<uint64_t> bounds{0};
+	};
+	std::unique_ptr<range[]> ranges;
+	size_t count = 0;
+
+	static uint64_t pack(const uint64_t begin, const uint64_t end) {
+		return begin << 32 | end;
+	}
+
+public:
+	static constexpr uint64_t max_size = UINT32_MAX;
+
+	// 把 [0, size) 平均分给 workers 个线程
+	void reset(const uint64_t size, const size_t workers) {
+		if (workers != count) {
+			ranges = std::make_unique<range[]>(workers);
+			count = workers;
+		}
+		for (size_t i = 0; i < workers; i++) {
+			ranges[i].bounds.store(pack(size * i / workers, size * (i + 1) / workers), std::memory_order_relaxed);
+		}
+	}
+
+	// 从自己的区间前端取至多 chunk 个下标
+	bool take(const size_t self, const uint64_t chunk, uint64_t& begin, uint64_t& end) {
+		uint64_t bounds = ranges[self].bounds.load(std::memory_order_acquire);
+		while (true) {
+			const uint64_t b = bounds >> 32, e = bounds & UINT32_MAX;
+			if (b >= e) return false;
+			const uint64_t next = std::min(b + chunk, e);
+			if (ranges[self].bounds.compare_exchange_weak(bounds, pack(next, e), std::memory_order_acq_rel)) {
+				begin = b;
+				end = next;
+				return true;
+			}
+		}
+	}
+
+	// 取下一块：先取自己的，没有时窃取其它线程剩余区间的后半段
+	bool next(const size_t self, const uint64_t chunk, uint64_t& begin, uint64_t& end) {
+		if (take(self, chunk, begin, end)) return true;
+		for (size_t k = 1; k < count; k++) {
+			auto& victim = ranges[(self + k) % count].bounds;
+			uint64_t bounds = victim.load(std::memory_order_acquire);
+			while (true) {
+				const uint64_t b = bounds >> 32, e = bounds & UINT32_MAX;
+				if (b >= e) break;
+				const uint64_t mid = b + (e - b) / 2;
+				if (victim.compare_exchange_weak(bounds, pack(b, mid), std::memory_order_acq_rel)) {
+					// 自己的区间已空，其它线程不会再从中窃取，可以直接写入
+					ranges[self].bounds.store(pack(mid, e), std::memory_order_release);
+					return take(self, chunk, begin, end);
+				}
+			}
+		}
+		return false;
+	}
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <csignal>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "esmel_callable.h"
+
+// 采样式性能分析器。
+// 定时器信号（SIGPROF）只累加一个计数，真正的采样由解释器在行边界上完成，
+// 因此关闭分析时每行只多一次对 pending 的判断。
+class EsmelProfiler {
+	struct counter {
+		uint64_t self = 0;
+		uint64_t total = 0;
+	};
+
+	std::unordered_map<uint32_t, counter> function_samples;			// 函数id -> 样本数
+	std::map<std::pair<uint32_t, uint64_t>, counter> line_samples;	// (函数id, 真实行号) -> 样本数
+	std::map<std::string, uint64_t> folded;							// 折叠调用栈 -> 样本数
+	uint64_t sample_count = 0;
+
+	static void on_signal(int) {
+		pending = pending + 1;
+	}
+
+public:
+	static inline volatile std::sig_atomic_t pending = 0;	// 尚未处理的定时器信号数
+
+	uint64_t interval_us = 1000;			// 采样间隔（CPU时间，微秒）
+	std::string output_prefix = "esmel";	// 输出 <prefix>.prof 与 <prefix>.folded
+
+	void start() {
+		struct sigaction sa{};
+		sa.sa_handler = on_signal;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGPROF, &sa, nullptr);
+
+		itimerval timer{};
+		timer.it_interval.tv_sec = static_cast<time_t>(interval_us / 1000000);
+		timer.it_interval.tv_usec = static_cast<suseconds_t>(interval_us % 1000000);
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, nullptr);
+	}
+
+	void stop() {
+		itimerval timer{};
+		setitimer(ITIMER_PROF, &timer, nullptr);
+		signal(SIGPROF, SIG_IGN);
+	}
+
+	// 记录一次调用栈样本。frames 为解释器的栈帧，底部的哨兵帧会被跳过。
+	template <class Frames>
+	void sample(const Frames& frames, const std::vector<esmel_function>& functions) {
+		const uint64_t weight = pending;
+		pending = 0;
+		if (weight == 0) return;
+		sample_count += weight;
+
+		std::unordered_set<uint32_t> seen_functions;
+		std::set<std::pair<uint32_t, uint64_t>> seen_lines;
+		std::string stack;
+		const auto* leaf = &frames.back();
+		for (const auto& f: frames) {
+			if (f.function_id >= functions.size()) continue;
+			const esmel_function& func = functions[f.function_id];
+			const uint64_t line = f.on_line < func.real_line_num.size() ? func.real_line_num[f.on_line] : 0;
+
+			if (seen_functions.insert(f.function_id).second) {
+				function_samples[f.function_id].total += weight;
+			}
+			if (seen_lines.insert({f.function_id, line}).second) {
+				line_samples[{f.function_id, line}].total += weight;
+			}
+			if (&f == leaf) {
+				function_samples[f.function_id].self += weight;
+				line_samples[{f.function_id, line}].self += weight;
+			}
+
+			if (!stack.empty()) stack += ';';
+			stack += func.name;
+		}
+		if (!stack.empty()) folded[stack] += weight;
+	}
+
+	// 写出分析结果
+	void report(const std::vector<esmel_function>& functions) const {
+		const double ms = static_cast<double>(interval_us) / 1000.0;
+
+		std::ofstream out(output_prefix + ".prof");
+		out << "# Esmel profile: " << sample_count << " samples, " << ms << " ms/sample\n\n";
+
+		out << "# Functions\n";
+		out << std::left << std::setw(12) << "self(ms)" << std::setw(12) << "total(ms)" << "function\n";
+		std::vector<std::pair<uint32_t, counter>> funcs(function_samples.begin(), function_samples.end());
+		std::ranges::sort(funcs, [](const auto& a, const auto& b) { return a.second.self > b.second.self; });
+		for (const auto& [id, c]: funcs) {
+			out << std::setw(12) << static_cast<double>(c.self) * ms << std::setw(12) << static_cast<double>(c.total) * ms
+				<< functions[id].name << " (" << functions[id].file_name << ")\n";
+		}
+
+		out << "\n# Lines\n";
+		out << std::left << std::setw(12) << "self(ms)" << std::setw(12) << "total(ms)" << "location\n";
+		std::vector<std::pair<std::pair<uint32_t, uint64_t>, counter>> lines(line_samples.begin(), line_samples.end());
+		std::ranges::sort(lines, [](const auto& a, const auto& b) { return a.second.self > b.second.self; });
+		for (const auto& [loc, c]: lines) {
+			out << std::setw(12) << static_cast<double>(c.self) * ms << std::setw(12) << static_cast<double>(c.total) * ms
+				<< functions[loc.first].name << " (" << functions[loc.first].file_name << ':' << loc.second << ")\n";
+		}
+
+		// 折叠栈格式，可直接交给 flamegraph.pl 等工具
+		std::ofstream folded_out(output_prefix + ".folded");
+		for (const auto& [stack, count]: folded) {
+			folded_out << stack << ' ' << count << '\n';
+		}
+	}
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+// 值的二进制序列化（Serialize / Deserialize）：在脚本之间传递数据，不经过文本。
+//
+// 格式（小端）：魔数 "ESMELDAT"、格式版本，之后是一个值。每个值以一字节的类型标记开头：
+//   Int / Float：8 字节；Boolean / Type：1 字节；Undefined：无内容；
+//   String：长度 + 内容；Array：元素个数 + 各元素；
+//   元素全为 Int 或全为 Float 的数组写为紧凑数组：元素个数 + 连续的 8 字节数值。
+// 读取时映射整个文件，数值块直接从映射中复制。
+// 写出与读取都用显式栈遍历嵌套的数组，不随嵌套层数消耗本机栈（协程的本机栈只有 256 KiB）。
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "esmel_binary.h"
+#include "esmel_gc.h"
+#include "esmel_object.h"
+
+constexpr char esmel_data_magic[8] = {'E', 'S', 'M', 'E', 'L', 'D', 'A', 'T'};
+constexpr uint32_t esmel_data_version = 1;
+constexpr uint32_t esmel_data_max_depth = 10000;		// 数组嵌套层数的上限
+
+// 类型标记：Type 的值，以及两种紧凑数组
+enum class esmel_data_tag: uint8_t {
+	packed_int = static_cast<uint8_t>(Type::TYPE) + 1,
+	packed_float
+};
+
+class esmel_serializer {
+	esmel_binary_writer out;
+	std::unordered_set<const esmel_array*> open;		// 正在写出的数组，用于发现包含自身的数组
+
+	// 元素都是 type 类型时写为紧凑数组
+	bool put_packed(const std::vector<EsmelObject>& elements, const Type type) {
+		if (elements.empty()) return false;
+		for (const auto& elem: elements) {
+			if (elem.type != type) return false;
+		}
+		out.put<uint8_t>(static_cast<uint8_t>(type == Type::INT ? esmel_data_tag::packed_int : esmel_data_tag::packed_float));
+		out.put<uint64_t>(elements.size());
+		const size_t begin = out.out.size();
+		out.out.resize(begin + elements.size() * sizeof(int64_t));
+		char* p = out.out.data() + begin;
+		for (const auto& elem: elements) {
+			std::memcpy(p, &elem.value, sizeof(int64_t));
+			p += sizeof(int64_t);
+		}
+		return true;
+	}
+
+	// 写出一个非数组的值；数组返回 false，由调用者处理
+	bool put_scalar(const EsmelObject& obj) {
+		if (obj.type == Type::ARRAY) return false;
+		out.put<uint8_t>(static_cast<uint8_t>(obj.type));
+		switch (obj.type) {
+		case Type::INT:
+			out.put(obj.value.int_v);
+			break;
+		case Type::FLOAT:
+			out.put(obj.value.float_v);
+			break;
+		case Type::BOOLEAN:
+			out.put<uint8_t>(obj.value.boolean_v);
+			break;
+		case Type::TYPE:
+			out.put<uint8_t>(static_cast<uint8_t>(obj.value.type_v));
+			break;
+		case Type::STRING:
+			out.put_string(obj.value.string_v->view());
+			break;
+		default:
+			break;
+		}
+		return true;
+	}
+
+	bool put_value(const EsmelObject& value) {
+		// 正在写出元素的数组及下一个元素的下标
+		struct level {
+			const esmel_array* array;
+			size_t next;
+		};
+		std::vector<level> levels;
+		const EsmelObject* obj = &value;
+		while (true) {
+			if (!put_scalar(*obj)) {
+				const esmel_array* array = obj->value.array_v;
+				const auto& elements = array->read();
+				if (!put_packed(elements, Type::INT) && !put_packed(elements, Type::FLOAT)) {
+					if (levels.size() >= esmel_data_max_depth) {
+						error = "Arrays are nested too deeply.";
+						return false;
+					}
+					if (!open.insert(array).second) {
+						error = "An array containing itself cannot be serialized.";
+						return false;
+					}
+					out.put<uint8_t>(static_cast<uint8_t>(Type::ARRAY));
+					out.put<uint64_t>(elements.size());
+					levels.push_back({array, 0});
+				}
+			}
+			// 取下一个要写出的元素，写完的数组出栈
+			while (!levels.empty() && levels.back().next == levels.back().array->read().size()) {
+				open.erase(levels.back().array);
+				levels.pop_back();
+			}
+			if (levels.empty()) return true;
+			obj = &levels.back().array->read()[levels.back().next++];
+		}
+	}
+
+public:
+	std::string error;		// 失败的原因
+
+	bool write(const std::string& path, const EsmelObject& value) {
+		out.out.append(esmel_data_magic, sizeof(esmel_data_magic));
+		out.put<uint32_t>(esmel_data_version);
+		if (!put_value(value)) return false;
+		if (!out.save(path)) {
+			error = "Cannot write file: " + path;
+			return false;
+		}
+		return true;
+	}
+};
+
+class esmel_deserializer {
+	esmel_binary_reader in;
+	EsmelObjectPool& objects;
+
+	// 读取一个值。非紧凑的数组只创建并分配好长度（nested 为真），元素由 get_value 之后填入
+	EsmelObject get_one(bool& nested) {
+		const auto tag = in.get<uint8_t>();
+		EsmelObject obj;
+		nested = false;
+		switch (tag) {
+		case static_cast<uint8_t>(Type::INT):
+			return in.get<int64_t>();
+		case static_cast<uint8_t>(Type::FLOAT):
+			return in.get<double>();
+		case static_cast<uint8_t>(Type::BOOLEAN):
+			return in.get<uint8_t>() != 0;
+		case static_cast<uint8_t>(Type::TYPE): {
+			const auto type = in.get<uint8_t>();
+			if (type > static_cast<uint8_t>(Type::TYPE)) in.ok = false;
+			return static_cast<Type>(type);
+		}
+		case static_cast<uint8_t>(Type::STRING):
+			return objects.createString(in.get_string());
+		case static_cast<uint8_t>(Type::UNDEFINED):
+			return obj;
+		case static_cast<uint8_t>(Type::ARRAY): {
+			obj = objects.createArray();
+			// 每个元素至少占一个字节
+			obj.value.array_v->v.resize(in.get_count(1));
+			objects.resized(obj.value.array_v, 0);
+			nested = in.ok && !obj.value.array_v->v.empty();
+			return obj;
+		}
+		case static_cast<uint8_t>(esmel_data_tag::packed_int):
+		case static_cast<uint8_t>(esmel_data_tag::packed_float): {
+			const Type type = tag == static_cast<uint8_t>(esmel_data_tag::packed_int) ? Type::INT : Type::FLOAT;
+			obj = objects.createArray();
+			auto& elements = obj.value.array_v->v;
+			elements.resize(in.get_count(sizeof(int64_t)));
+			const char* p = in.data + in.pos;
+			for (auto& elem: elements) {
+				elem.type = type;
+				std::memcpy(&elem.value, p, sizeof(int64_t));
+				p += sizeof(int64_t);
+			}
+			in.pos += elements.size() * sizeof(int64_t);
+			objects.resized(obj.value.array_v, 0);
+			return obj;
+		}
+		default:
+			in.ok = false;
+			return obj;
+		}
+	}
+
+	EsmelObject get_value() {
+		// 正在填入元素的数组及下一个元素的下标
+		struct level {
+			esmel_array* array;
+			size_t next;
+		};
+		std::vector<level> levels;
+		bool nested;
+		const EsmelObject value = get_one(nested);
+		if (nested) levels.push_back({value.value.array_v, 0});
+		while (in.ok && !levels.empty()) {
+			level& top = levels.back();
+			if (top.next == top.array->v.size()) {
+				levels.pop_back();
+				continue;
+			}
+			EsmelObject& elem = top.array->v[top.next++];
+			elem = get_one(nested);
+			if (!nested) continue;
+			if (levels.size() >= esmel_data_max_depth) {
+				in.ok = false;
+				break;
+			}
+			levels.push_back({elem.value.array_v, 0});
+		}
+		return value;
+	}
+
+public:
+	explicit esmel_deserializer(EsmelObjectPool& objects) : objects(objects) {}
+
+	// 读取文件中的值，对象创建在 objects 中。文件不存在或已损坏时返回 false
+	bool read(const std::string& path, EsmelObject& value) {
+		if (!in.map(path) || in.size < sizeof(esmel_data_magic)
+			|| std::memcmp(in.data, esmel_data_magic, sizeof(esmel_data_magic)) != 0) return false;
+		in.pos = sizeof(esmel_data_magic);
+		if (in.get<uint32_t>() != esmel_data_version) return false;
+		value = get_value();
+		return in.ok && in.pos == in.size;
+	}
+};
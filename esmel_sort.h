@@ -0,0 +1,181 @@
+#pragma once
+
+// Sort / SortBy：按元素类型选择排序方法，结果都是稳定的。
+//   全为 Int 或全为 Float：把数值映射为保持顺序的 64 位无符号键，做 LSD 基数排序；
+//   全为 String：先比较缓存的前 8 字节，相同时再比较全部内容；
+//   其它（混合类型）：先按类型分组 Undefined < 数值（Int 与 Float 按数值比较） < Boolean < String < Array < Type，
+//   组内 Boolean 与 String 按值、Type 按类型编号比较，Array 之间保持原来的顺序。
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "esmel_object.h"
+
+constexpr size_t esmel_radix_min_size = 256;		// 更短的数组直接比较排序
+
+// 按无符号整数比较的顺序与数值顺序相同的键
+inline uint64_t esmel_int_key(const int64_t v) {
+	return static_cast<uint64_t>(v) ^ (1ull << 63);
+}
+
+// 负数取反、非负数置符号位；NaN 先去掉符号位，因此总是排在最后（包括正无穷之后）
+inline uint64_t esmel_float_key(const double v) {
+	auto bits = std::bit_cast<uint64_t>(v);
+	if (std::isnan(v)) bits &= ~(1ull << 63);
+	return bits >> 63 ? ~bits : bits | (1ull << 63);
+}
+
+inline double esmel_float_from_key(const uint64_t key) {
+	return std::bit_cast<double>(key >> 63 ? key & ~(1ull << 63) : ~key);
+}
+
+// 稳定的 LSD 基数排序，每趟处理键的 8 位；所有元素在某一字节上都相同时跳过这一趟
+template <class T, class Key>
+void esmel_radix_sort(std::vector<T>& items, const Key key) {
+	const size_t n = items.size();
+	if (n < esmel_radix_min_size) {
+		std::stable_sort(items.begin(), items.end(), [&](const T& a, const T& b) { return key(a) < key(b); });
+		return;
+	}
+	std::array<std::array<size_t, 256>, 8> counts{};
+	for (const auto& item: items) {
+		const uint64_t k = key(item);
+		for (size_t b = 0; b < 8; b++) counts[b][(k >> (8 * b)) & 0xff]++;
+	}
+	std::vector<T> buffer(n);
+	const uint64_t first = key(items[0]);
+	for (size_t b = 0; b < 8; b++) {
+		auto& offsets = counts[b];
+		if (offsets[(first >> (8 * b)) & 0xff] == n) continue;
+		size_t sum = 0;
+		for (auto& c: offsets) {
+			const size_t count = c;
+			c = sum;
+			sum += count;
+		}
+		for (const auto& item: items) buffer[offsets[(key(item) >> (8 * b)) & 0xff]++] = item;
+		items.swap(buffer);
+	}
+}
+
+// 字符串的前 8 字节（按大端拼成整数，不足的补零），大多数比较只需比较它
+inline uint64_t esmel_string_prefix(const std::string_view s) {
+	unsigned char bytes[8] = {};
+	std::memcpy(bytes, s.data(), std::min<size_t>(s.size(), 8));
+	uint64_t prefix = 0;
+	for (const unsigned char c: bytes) prefix = prefix << 8 | c;
+	return prefix;
+}
+
+// 混合类型时的分组
+inline int esmel_sort_rank(const Type type) {
+	switch (type) {
+	case Type::UNDEFINED: return 0;
+	case Type::INT: case Type::FLOAT: return 1;
+	case Type::BOOLEAN: return 2;
+	case Type::STRING: return 3;
+	case Type::ARRAY: return 4;
+	case Type::TYPE: return 5;
+	}
+	return 6;
+}
+
+// 混合类型的比较（a < b）。Int 与 Float 都转为 long double，64 位整数也能精确表示。
+// NaN 与基数排序一样排在所有数值之后，彼此相等，使比较保持严格弱序
+inline bool esmel_sort_less(const EsmelObject& a, const EsmelObject& b) {
+	const int ra = esmel_sort_rank(a.type), rb = esmel_sort_rank(b.type);
+	if (ra != rb) return ra < rb;
+	switch (a.type) {
+	case Type::INT: case Type::FLOAT: {
+		const long double x = a.type == Type::INT ? static_cast<long double>(a.value.int_v) : a.value.float_v;
+		const long double y = b.type == Type::INT ? static_cast<long double>(b.value.int_v) : b.value.float_v;
+		if (std::isnan(x) || std::isnan(y)) return !std::isnan(x);
+		return x < y;
+	}
+	case Type::BOOLEAN:
+		return a.value.boolean_v < b.value.boolean_v;
+	case Type::STRING:
+		return a.value.string_v->view() < b.value.string_v->view();
+	case Type::TYPE:
+		return a.value.type_v < b.value.type_v;
+	default:
+		return false;
+	}
+}
+
+// 所有元素都是 type 类型
+inline bool esmel_all_of_type(const std::vector<EsmelObject>& values, const Type type) {
+	return std::ranges::all_of(values, [type](const EsmelObject& v) { return v.type == type; });
+}
+
+// 求按 keys 排序后的下标顺序（稳定）
+inline std::vector<size_t> esmel_sort_order(const std::vector<EsmelObject>& keys) {
+	const size_t n = keys.size();
+	std::vector<size_t> order(n);
+	if (n == 0) return order;
+	const bool ints = esmel_all_of_type(keys, Type::INT);
+	if (ints || esmel_all_of_type(keys, Type::FLOAT)) {
+		struct entry {
+			uint64_t key;
+			size_t index;
+		};
+		std::vector<entry> entries(n);
+		for (size_t i = 0; i < n; i++) {
+			entries[i] = {ints ? esmel_int_key(keys[i].value.int_v) : esmel_float_key(keys[i].value.float_v), i};
+		}
+		esmel_radix_sort(entries, [](const entry& e) { return e.key; });
+		for (size_t i = 0; i < n; i++) order[i] = entries[i].index;
+	} else if (esmel_all_of_type(keys, Type::STRING)) {
+		struct entry {
+			uint64_t prefix;
+			std::string_view s;
+			size_t index;
+		};
+		std::vector<entry> entries(n);
+		for (size_t i = 0; i < n; i++) {
+			const std::string_view s = keys[i].value.string_v->view();
+			entries[i] = {esmel_string_prefix(s), s, i};
+		}
+		std::ranges::stable_sort(entries, [](const entry& a, const entry& b) {
+			if (a.prefix != b.prefix) return a.prefix < b.prefix;
+			return a.s.size() > 8 && b.s.size() > 8 ? a.s.substr(8) < b.s.substr(8) : a.s.size() < b.s.size();
+		});
+		for (size_t i = 0; i < n; i++) order[i] = entries[i].index;
+	} else {
+		for (size_t i = 0; i < n; i++) order[i] = i;
+		std::ranges::stable_sort(order, [&](const size_t a, const size_t b) { return esmel_sort_less(keys[a], keys[b]); });
+	}
+	return order;
+}
+
+// 按 keys 的顺序重排 values（两者长度相同）
+inline void esmel_sort_by(std::vector<EsmelObject>& values, const std::vector<EsmelObject>& keys) {
+	const std::vector<size_t> order = esmel_sort_order(keys);
+	std::vector<EsmelObject> sorted(values.size());
+	for (size_t i = 0; i < order.size(); i++) sorted[i] = values[order[i]];
+	std::ranges::copy(sorted, values.begin());
+}
+
+inline void esmel_sort(std::vector<EsmelObject>& values) {
+	// 数值可以由键还原，不需要经过下标
+	const bool ints = esmel_all_of_type(values, Type::INT);
+	if (!values.empty() && (ints || esmel_all_of_type(values, Type::FLOAT))) {
+		std::vector<uint64_t> keys(values.size());
+		for (size_t i = 0; i < values.size(); i++) {
+			keys[i] = ints ? esmel_int_key(values[i].value.int_v) : esmel_float_key(values[i].value.float_v);
+		}
+		esmel_radix_sort(keys, [](const uint64_t k) { return k; });
+		for (size_t i = 0; i < values.size(); i++) {
+			if (ints) values[i] = static_cast<int64_t>(keys[i] ^ (1ull << 63));
+			else values[i] = esmel_float_from_key(keys[i]);
+		}
+		return;
+	}
+	esmel_sort_by(values, values);
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+// 执行统计：统计执行的操作码、相邻操作码对、函数调用次数与GC情况。
+// 仅在以 ESMEL_STATS 构建时（cmake -DESMEL_STATS=ON）参与编译，普通构建没有任何开销。
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "esmel_callable.h"
+
+constexpr size_t operation_count = static_cast<size_t>(operation::EndEnum);
+
+// 操作码名称，顺序与 operation 一致
+constexpr std::array<const char*, operation_count + 1> operation_names = {
+	"CreateInt", "CreateFloat", "CreateBoolean", "GetStaticStr", "CreateUndefined", "CreateType",
+	"GetVar", "SetVar",
+	"Add", "Sub", "Mul", "Div", "Mod",
+	"AddBy", "SubBy", "MulBy", "DivBy", "ModBy",
+	"Copy", "Typeof", "Equal", "Gc",
+	"Print", "Println", "Readln", "Input",
+	"Goto", "If", "Return",
+	"And", "Or", "Not",
+	"Call", "Error",
+	"GetTime",
+	"Less",
+	"ELess",
+	"Greater",
+	"EGreater",
+	"NewArray", "SetAt", "GetAt", "Append", "GetLength", "Link",
+	"GetHeapSize", "GetPeakHeapSize",
+	"GotoUnless",
+	"LoadInvariant", "StoreInvariant",
+	"GetAtUnchecked", "SetAtUnchecked",
+	"GetStaticStrLocal", "NewArrayLocal", "CopyLocal", "LinkLocal",
+	"Spawn", "Yield", "Await",
+	"ParallelMap", "ParallelFor",
+	"Snapshot",
+	"CallNative",
+	"Serialize", "Deserialize",
+	"ReadFile", "Substring", "Split",
+	"Sort", "SortBy",
+	"Find", "Contains", "Replace", "Trim",
+	"LazyCompile",
+	"EndEnum"
+};
+static_assert(std::string_view(operation_names[operation_count]) == "EndEnum", "operation_names is out of sync with operation");
+
+struct EsmelStats {
+	std::array<uint64_t, operation_count> ops{};
+	std::array<std::array<uint64_t, operation_count + 1>, operation_count + 1> pairs{};	// pairs[前][后]，EndEnum 表示开始
+	std::vector<uint64_t> calls;			// 函数id -> 调用次数
+	uint64_t gc_runs = 0;
+	uint64_t strings_freed = 0;
+	uint64_t arrays_freed = 0;
+	operation last = operation::EndEnum;
+
+	void count_op(const operation op) {
+		ops[static_cast<size_t>(op)]++;
+		pairs[static_cast<size_t>(last)][static_cast<size_t>(op)]++;
+		last = op;
+	}
+
+	void count_call(const uint32_t id) {
+		if (id >= calls.size()) calls.resize(id + 1);
+		calls[id]++;
+	}
+
+	void count_gc(const uint64_t strings, const uint64_t arrays) {
+		gc_runs++;
+		strings_freed += strings;
+		arrays_freed += arrays;
+	}
+
+	// 加上另一个线程的统计（并行工作解释器的计数）
+	void merge(const EsmelStats& other) {
+		for (size_t i = 0; i < operation_count; i++) ops[i] += other.ops[i];
+		for (size_t a = 0; a <= operation_count; a++) {
+			for (size_t b = 0; b <= operation_count; b++) pairs[a][b] += other.pairs[a][b];
+		}
+		if (other.calls.size() > calls.size()) calls.resize(other.calls.size());
+		for (size_t i = 0; i < other.calls.size(); i++) calls[i] += other.calls[i];
+		gc_runs += other.gc_runs;
+		strings_freed += other.strings_freed;
+		arrays_freed += other.arrays_freed;
+	}
+
+	// 以JSON格式输出，按次数降序
+	void dump(std::ostream& out, const std::vector<esmel_function>& functions) const {
+		out << "{\n  \"ops\": {";
+		std::vector<size_t> order(operation_count);
+		for (size_t i = 0; i < operation_count; i++) order[i] = i;
+		std::ranges::stable_sort(order, [this](size_t a, size_t b) { return ops[a] > ops[b]; });
+		bool first = true;
+		for (const size_t i: order) {
+			if (ops[i] == 0) continue;
+			out << (first ? "\n" : ",\n") << "    \"" << operation_names[i] << "\": " << ops[i];
+			first = false;
+		}
+
+		out << "\n  },\n  \"pairs\": [";
+		struct pair_count { size_t a, b; uint64_t n; };
+		std::vector<pair_count> all_pairs;
+		for (size_t a = 0; a <= operation_count; a++) {
+			for (size_t b = 0; b < operation_count; b++) {
+				if (pairs[a][b]) all_pairs.push_back({a, b, pairs[a][b]});
+			}
+		}
+		std::ranges::stable_sort(all_pairs, [](const pair_count& x, const pair_count& y) { return x.n > y.n; });
+		first = true;
+		for (const auto& [a, b, n]: all_pairs) {
+			if (a == operation_count) continue;		// 第一条指令没有前驱
+			out << (first ? "\n" : ",\n") << "    {\"first\": \"" << operation_names[a] << "\", \"second\": \""
+				<< operation_names[b] << "\", \"count\": " << n << '}';
+			first = false;
+		}
+
+		out << "\n  ],\n  \"calls\": {";
+		first = true;
+		for (size_t i = 0; i < calls.size() && i < functions.size(); i++) {
+			if (calls[i] == 0) continue;
+			out << (first ? "\n" : ",\n") << "    \"" << functions[i].name << "\": " << calls[i];
+			first = false;
+		}
+
+		out << "\n  },\n  \"gc\": {\"runs\": " << gc_runs << ", \"strings_freed\": " << strings_freed
+			<< ", \"arrays_freed\": " << arrays_freed << "}\n}\n";
+	}
+};
+
+// 每个线程各自统计；并行执行结束后，工作解释器的计数合并到调用者的统计中
+inline thread_local EsmelStats esmel_stats;
@@ -0,0 +1,101 @@
+#pragma once
+
+// 字符串查找（Find、Contains、Split、Replace 共用）。
+// 多字节的子串用 SIMD 同时比较每个候选位置的首字节与末字节，两者都相同时再比较中间部分；
+// AVX2 在运行时检测，不支持时使用 x86-64 都有的 SSE2，其它平台使用标准库。单字节的查找直接使用 memchr。
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+constexpr size_t esmel_npos = std::string_view::npos;
+
+// 在 s[0, n) 中查找长度为 k（k >= 2，n >= k）的 needle
+using esmel_find_kernel = size_t (*)(const char* s, size_t n, const char* needle, size_t k);
+
+inline size_t esmel_find_scalar(const char* s, const size_t n, const char* needle, const size_t k) {
+	return std::string_view(s, n).find(std::string_view(needle, k));
+}
+
+// 剩余不足一个块的部分
+inline size_t esmel_find_tail(const char* s, const size_t n, const size_t i, const char* needle, const size_t k) {
+	const size_t pos = esmel_find_scalar(s + i, n - i, needle, k);
+	return pos == esmel_npos ? esmel_npos : i + pos;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+inline size_t esmel_find_avx2(const char* s, const size_t n, const char* needle, const size_t k) {
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+	size_t i = 0;
+	for (; i + k - 1 + 32 <= n; i += 32) {
+		const __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+		const __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + k - 1));
+		auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last))));
+		while (mask) {
+			const int bit = std::countr_zero(mask);
+			if (std::memcmp(s + i + bit + 1, needle + 1, k - 2) == 0) return i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return esmel_find_tail(s, n, i, needle, k);
+}
+
+inline size_t esmel_find_sse2(const char* s, const size_t n, const char* needle, const size_t k) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[k - 1]);
+	size_t i = 0;
+	for (; i + k - 1 + 16 <= n; i += 16) {
+		const __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+		const __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + k - 1));
+		auto mask = static_cast<uint32_t>(_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last))));
+		while (mask) {
+			const int bit = std::countr_zero(mask);
+			if (std::memcmp(s + i + bit + 1, needle + 1, k - 2) == 0) return i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return esmel_find_tail(s, n, i, needle, k);
+}
+#endif
+
+inline esmel_find_kernel esmel_select_find_kernel() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return esmel_find_avx2;
+	return esmel_find_sse2;
+#else
+	return esmel_find_scalar;
+#endif
+}
+
+inline const esmel_find_kernel esmel_find_impl = esmel_select_find_kernel();
+
+// 从 from 开始查找 needle 第一次出现的位置，未找到时返回 esmel_npos
+inline size_t esmel_find(const std::string_view haystack, const std::string_view needle, const size_t from = 0) {
+	if (from > haystack.size() || needle.size() > haystack.size() - from) return esmel_npos;
+	if (needle.empty()) return from;
+	const char* s = haystack.data() + from;
+	const size_t n = haystack.size() - from;
+	size_t pos;
+	if (needle.size() == 1) {
+		const void* p = std::memchr(s, needle[0], n);
+		pos = p ? static_cast<size_t>(static_cast<const char*>(p) - s) : esmel_npos;
+	} else {
+		pos = esmel_find_impl(s, n, needle.data(), needle.size());
+	}
+	return pos == esmel_npos ? esmel_npos : from + pos;
+}
+
+inline bool esmel_is_space(const char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
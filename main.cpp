@@ -8,41 +8,214 @@
 
 #include "esmel_compiler.h"
 #include "esmel_interpreter.h"
+#include "esmel_linker.h"
 
 using std::vector, std::string, std::unordered_map, std::map, std::stack, std::nullptr_t, std::shared_ptr,
 		std::unordered_set;
 
 
+// 解析带可选 K/M/G 后缀的字节数，如 512M
+static uint64_t parse_size(const string& text)
+{
+	uint64_t value = 0;
+	auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+	if (ec != std::errc()) {
+		std::cerr << "Error: Invalid size: " << text << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	switch (ptr == text.data() + text.size() ? '\0' : std::toupper(*ptr)) {
+	case 'G': value <<= 30; break;
+	case 'M': value <<= 20; break;
+	case 'K': value <<= 10; break;
+	default: break;
+	}
+	return value;
+}
+
 int main(int argc, char* argv[])
 {
 	ios_base::sync_with_stdio(false);
-	if (argc == 1) {
+	vector<string> files;
+	bool profile = false;
+	EsmelProfiler profiler;
+	bool alloc_profile = false;
+	EsmelAllocProfiler alloc_profiler;
+	string stats_file = "esmel_stats.json";
+	uint64_t heap_limit = 0;
+	double gc_growth = 2.0;
+	size_t threads = 0;
+	string snapshot_file, image_file;
+	bool memoize = true;
+	bool lazy = false;
+	uint64_t budget = 0;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--profile") {
+			profile = true;
+		} else if (arg.starts_with("--profile=")) {
+			profile = true;
+			profiler.output_prefix = arg.substr(10);
+		} else if (arg == "--alloc-profile") {
+			alloc_profile = true;
+		} else if (arg.starts_with("--alloc-profile=")) {
+			alloc_profile = true;
+			alloc_profiler.output_prefix = arg.substr(16);
+		} else if (arg.starts_with("--heap-limit=")) {
+			heap_limit = parse_size(arg.substr(13));
+		} else if (arg.starts_with("--gc-growth=")) {
+			gc_growth = std::stod(arg.substr(12));
+			if (!(gc_growth >= 0)) {
+				std::cerr << "Error: --gc-growth must not be negative" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		} else if (arg.starts_with("--threads=")) {
+			threads = std::stoul(arg.substr(10));
+		} else if (arg.starts_with("--snapshot=")) {
+			snapshot_file = arg.substr(11);
+		} else if (arg.starts_with("--image=")) {
+			image_file = arg.substr(8);
+		} else if (arg.starts_with("--budget=")) {
+			budget = std::stoull(arg.substr(9));
+			if (budget == 0) {
+				std::cerr << "Error: --budget must be at least 1 (omit it for no limit)" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		} else if (arg == "--lazy") {
+			lazy = true;
+		} else if (arg == "--no-memoize") {
+			memoize = false;
+		} else if (arg.starts_with("--stats=")) {
+			stats_file = arg.substr(8);
+		} else {
+			files.push_back(arg);
+		}
+	}
+	// 按需编译需要保留源文件的编译器，只能直接运行单个源文件
+	if (lazy && (!image_file.empty() || files.size() > 1 || (!files.empty() && files[0].ends_with(".esmo")))) {
+		std::cerr << "Error: --lazy can only be used to run a single source file (not with modules, compile or --image)" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	// esmel compile a.esm b.esm：单独编译为 a.esmo b.esmo，供之后链接
+	if (!files.empty() && files[0] == "compile") {
+		for (size_t i = 1; i < files.size(); i++) {
+			string content;
+			if (!esmel_read_source(files[i], content)) {
+				std::cerr << "Error: Cannot open file: " << files[i] << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			if (!esmel_write_module(esmel_module_path(files[i]), esmel_compile_module(files[i], esmel_source_hash(content)))) {
+				std::cerr << "Error: Cannot write " << esmel_module_path(files[i]) << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		return 0;
+	}
+	if (files.empty() && image_file.empty()) {
 		std::cout << 	""
 	"      *          Welcome to the Esmel Language!\n"
 	"     ***         Author: Sharll\n"
 	"   *******       Version: v3.8-official-pre-release-1\n"
 	"*************    To run a program directly, use `esmel your_esmel_code.esm`\n"
 	"   *******       To compile a program,      use `esmel compile your_esmel_code.esm`\n"
+	"                 To link and run modules,   use `esmel main.esm lib.esm` (or the compiled .esmo files)\n"
 	"     ***         Hope you'll have a pleasant journey!\n"
-	"      *          To get further informationn, visit https://github.com/Sharll-large/Esmel" << std::endl;
+	"      *          To get further informationn, visit https://github.com/Sharll-large/Esmel\n"
+	"\n"
+	"Options:\n"
+	"  --profile[=prefix]    Sample the running script and write <prefix>.prof and <prefix>.folded\n"
+	"  --alloc-profile[=prefix]  Record which lines allocate and keep memory, write <prefix>.alloc (also on SIGUSR1)\n"
+	"  --heap-limit=size     Fail once the live heap exceeds size bytes (K/M/G suffixes allowed)\n"
+	"  --gc-growth=factor    Collect automatically when the heap grows by factor since the last GC (0: never)\n"
+	"  --threads=n           Number of threads used by ParallelMap and ParallelFor (default: all cores)\n"
+	"  --snapshot=file       Save an image to file when the script reaches `Snapshot`, then exit\n"
+	"  --image=file          Resume from an image saved with --snapshot instead of running a script\n"
+	"  --budget=n            Fail after n jumps and function calls (loops and recursion that never end)\n"
+	"  --lazy                Compile each function when it is first called (only for a single source file)\n"
+	"  --no-memoize          Do not cache the results of pure recursive functions\n"
+	"  --stats=file          Where to write opcode statistics (builds with -DESMEL_STATS=ON only)" << std::endl;
 		return 0;
 	}
-	if (argc == 2) {
-		// string file =  argv[1];
-		string file = argv[1];
-		string mainfunc = "main";
 
+	EsmelInterpreter esm;
+	esmel_image image;
+	const bool modular = files.size() > 1 || (files.size() == 1 && files[0].ends_with(".esmo"));
+	std::unique_ptr<esmel_compiler> lazy_compiler;
+	if (lazy) {
+		// 编译器保留到运行结束，函数第一次被调用时才编译
+		lazy_compiler = std::make_unique<esmel_compiler>();
+		lazy_compiler->lazy = true;
+		lazy_compiler->add_target(files[0]);
+		lazy_compiler->compile();
+		esm.functions = lazy_compiler->esmel_functions;
+		esm.static_str = lazy_compiler->static_strs;
+		esm.lazy_compiler = lazy_compiler.get();
+	} else if (image_file.empty() && !modular) {
 		auto* e = new esmel_compiler();
-		e->add_target(file);
+		e->add_target(files[0]);
 		e->compile();
+		esm.functions = std::move(e->esmel_functions);
+		esm.static_str = std::move(e->static_strs);
+		delete e;
+	} else if (image_file.empty()) {
+		// 多个文件：各自编译（或取缓存的目标文件）后链接
+		esmel_linker linker;
+		for (const auto& f: files) {
+			if (!f.ends_with(".esmo")) {
+				linker.add(esmel_load_module(f));
+				continue;
+			}
+			esmel_module module;
+			if (!esmel_read_module(f, module)) {
+				std::cerr << "Error: Cannot load module: " << f << " (missing, damaged or compiled by another Esmel build)" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			linker.add(std::move(module));
+		}
+		linker.link();
+		esm.functions = std::move(linker.functions);
+		esm.static_str = std::move(linker.static_strs);
+	} else {
+		// 映像中已有编译后的函数与初始化好的堆
+		if (!esmel_image_reader().read(image_file, esm.objects, image)) {
+			std::cerr << "Error: Cannot load image: " << image_file << " (missing, damaged or saved by another Esmel build)" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		esm.functions = std::move(image.functions);
+		esm.static_str = std::move(image.static_str);
+	}
+	if (!memoize) {
+		for (auto& func: esm.functions) func.memoize = false;
+	}
+	esm.snapshot_file = snapshot_file;
+	esm.stats_file = stats_file;
+	esm.objects.heap_limit = heap_limit;
+	esm.objects.set_gc_growth(gc_growth);
+	if (threads) esm.parallel_threads = threads;
+	if (budget) esm.budget = budget;
 
-		EsmelInterpreter esm;
-		esm.functions = e->esmel_functions;
-		esm.static_str = e->static_strs;
+	if (profile) {
+		esm.profiler = &profiler;
+		profiler.start();
+	}
+	if (alloc_profile) {
+		alloc_profiler.locate = [&esm] {
+			return std::pair{esm.stack_frame.back().function_id, esm.stack_frame.back().on_line};
+		};
+		esm.objects.alloc_profiler = &alloc_profiler;
+		alloc_profiler.start();
+	}
 
-		delete e;
+	if (image_file.empty()) esm.call(0);
+	else esm.resume(image);
 
-		esm.call(0);
+	if (profile) {
+		profiler.stop();
+		profiler.report(esm.functions);
 	}
+	if (alloc_profile) alloc_profiler.report(esm.functions);
+#ifdef ESMEL_STATS
+	std::ofstream stats_out(stats_file);
+	esmel_stats.dump(stats_out, esm.functions);
+#endif
 	return 0;
 }